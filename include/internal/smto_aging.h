@@ -0,0 +1,106 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2022 Chenming C (ccm@ccm.ink)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#ifndef SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_AGING_H_
+#define SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_AGING_H_
+
+#include <stdint.h>
+#include "internal/smto_flow_key.h"
+
+/// The resolution of the last-seen time of the flows in software.
+#define AGING_TICK_MS 100
+/// The ticks a flow handled in software can be idle before it is removed.
+#define AGING_TIMEOUT_TICKS (FLOW_TIMEOUT_SECOND * 1000 / AGING_TICK_MS)
+/// The slots of the aging wheel, a power of 2 greater than AGING_TIMEOUT_TICKS.
+#define AGING_WHEEL_SLOTS 128
+/// The max flows checked by the aging wheel in each loop of a packet worker, whose removals fit in the closing flows.
+#define AGING_BATCH_SIZE MAX_BULK_SIZE
+
+/**
+ * The timer wheel of a packet worker to remove the flows handled in software after FLOW_TIMEOUT_SECOND idle, as the
+ * rte_flow aging only covers the offloaded ones. All the flows share one timeout, so a single level of slots is enough.
+ *
+ * Each flow created by the worker is linked into the slot of the tick when it would expire, by the aging_next of its
+ * out-direction key and the aging_pprev of its in-direction key. The packets only refresh the last_seen of their flow
+ * key with the tick of the burst, and the flow is moved to a later slot when its slot is reached, so the hot path never
+ * touches the wheel.
+ */
+struct smto_aging_wheel {
+  struct smto_flow_key *slots[AGING_WHEEL_SLOTS]; ///< The out-direction keys of the flows to check at each tick.
+  uint32_t now; ///< The current tick, advanced by the worker once per loop.
+  uint32_t next_tick; ///< The tick of the next slot to check, never after now + 1.
+};
+
+/**
+ * Get the tick of the last packet of a flow in either direction. The in-direction key may be written by another
+ * worker at the same time.
+ *
+ * @param flow_key The out-direction flow key.
+ * @return The later last_seen of both directions.
+ */
+static inline uint32_t aging_last_seen(const struct smto_flow_key *flow_key) {
+  uint32_t last_seen = flow_key->last_seen;
+  uint32_t symmetrical_last_seen = __atomic_load_n(&flow_key->symmetrical_flow_key->last_seen, __ATOMIC_RELAXED);
+  return (int32_t) (symmetrical_last_seen - last_seen) > 0 ? symmetrical_last_seen : last_seen;
+}
+
+/**
+ * Link a flow into the slot of a tick. The tick is kept after the slot being checked and within a round of the wheel,
+ * a flow put into an earlier slot than its expiration is just checked again.
+ *
+ * @param wheel The aging wheel of the worker which creates the flow.
+ * @param flow_key The out-direction flow key.
+ * @param tick The tick to check the flow.
+ */
+static inline void aging_wheel_add(struct smto_aging_wheel *wheel, struct smto_flow_key *flow_key, uint32_t tick) {
+  int32_t delay = (int32_t) (tick - wheel->next_tick);
+  if (delay <= 0) {
+    tick = wheel->next_tick + 1;
+  } else if (delay >= AGING_WHEEL_SLOTS) {
+    tick = wheel->next_tick + AGING_WHEEL_SLOTS - 1;
+  }
+  struct smto_flow_key **head = &wheel->slots[tick & (AGING_WHEEL_SLOTS - 1)];
+  flow_key->aging_next = *head;
+  if (*head != NULL) {
+    (*head)->symmetrical_flow_key->aging_pprev = &flow_key->aging_next;
+  }
+  *head = flow_key;
+  flow_key->symmetrical_flow_key->aging_pprev = head;
+}
+
+/**
+ * Unlink a flow from the aging wheel.
+ *
+ * @param flow_key The out-direction flow key.
+ */
+static inline void aging_wheel_del(struct smto_flow_key *flow_key) {
+  struct smto_flow_key **pprev = flow_key->symmetrical_flow_key->aging_pprev;
+  struct smto_flow_key *next = flow_key->aging_next;
+  *pprev = next;
+  if (next != NULL) {
+    next->symmetrical_flow_key->aging_pprev = pprev;
+  }
+}
+
+#endif //SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_AGING_H_
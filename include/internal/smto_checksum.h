@@ -0,0 +1,150 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2022 Chenming C (ccm@ccm.ink)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#ifndef SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_CHECKSUM_H_
+#define SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_CHECKSUM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <rdarm.h>
+#include "smto.h"
+#include "internal/smto_flow_key.h"
+
+/// The checksum field in a packed header, which may not be aligned.
+typedef uint16_t cksum_field_t __attribute__((aligned(1)));
+
+/**
+ * Add the difference of a rewritten 32-bit field to a ones' complement sum, as ~m + m' of RFC 1624.
+ * The fields are in network byte order, which does not matter to the ones' complement sum.
+ */
+static inline uint32_t cksum_delta_add32(uint32_t sum, uint32_t old_value, uint32_t new_value) {
+  old_value = ~old_value;
+  return sum + (old_value & 0xffff) + (old_value >> 16) + (new_value & 0xffff) + (new_value >> 16);
+}
+
+/**
+ * Add the difference of a rewritten 16-bit field to a ones' complement sum.
+ */
+static inline uint32_t cksum_delta_add16(uint32_t sum, uint16_t old_value, uint16_t new_value) {
+  return sum + (uint16_t) ~old_value + new_value;
+}
+
+/**
+ * Fold a ones' complement sum into 16 bits.
+ */
+static inline uint16_t cksum_fold(uint32_t sum) {
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t) sum;
+}
+
+/**
+ * Get the checksum differences of rewriting the addresses and ports of a flow, which are the same for all the packets
+ * in the flow, so each packet only needs one addition.
+ *
+ * @param old_tuple The tuple before rewriting.
+ * @param nat The rewrite template, whose ipv4_cksum_delta and l4_cksum_delta are set. The ipv4 delta only covers the
+ *            addresses, the tcp/udp delta covers the addresses in pseudo header and the ports.
+ */
+static inline void get_nat_cksum_delta(const struct rdarm_five_tuple *old_tuple, struct smto_nat_template *nat) {
+  uint32_t sum = cksum_delta_add32(0, old_tuple->ip1, nat->ip1);
+  sum = cksum_delta_add32(sum, old_tuple->ip2, nat->ip2);
+  nat->ipv4_cksum_delta = cksum_fold(sum);
+  sum = cksum_delta_add16(nat->ipv4_cksum_delta, old_tuple->port1, nat->port1);
+  sum = cksum_delta_add16(sum, old_tuple->port2, nat->port2);
+  nat->l4_cksum_delta = cksum_fold(sum);
+}
+
+/**
+ * Get the tcp/udp checksum difference of rewriting the addresses and ports of an ipv6 flow, ipv6 has no header
+ * checksum.
+ *
+ * @param old_tuple The tuple before rewriting.
+ * @param nat6 The rewrite template, whose l4_cksum_delta is set. It covers the addresses in pseudo header and the
+ *             ports.
+ */
+static inline void get_nat6_cksum_delta(const struct smto_ipv6_tuple *old_tuple,
+                                        struct smto_nat6_template *nat6) {
+  uint32_t sum = 0;
+  uint32_t old_words[8], new_words[8];
+  memcpy(old_words, old_tuple->ip1, sizeof(old_tuple->ip1));
+  memcpy(old_words + 4, old_tuple->ip2, sizeof(old_tuple->ip2));
+  memcpy(new_words, nat6->ip1, sizeof(nat6->ip1));
+  memcpy(new_words + 4, nat6->ip2, sizeof(nat6->ip2));
+  for (int i = 0; i < 8; i++) {
+    sum = cksum_fold(cksum_delta_add32(sum, old_words[i], new_words[i]));
+  }
+  sum = cksum_delta_add16(sum, old_tuple->port1, nat6->port1);
+  sum = cksum_delta_add16(sum, old_tuple->port2, nat6->port2);
+  nat6->l4_cksum_delta = cksum_fold(sum);
+}
+
+/**
+ * The checksums to update in a burst, which are gathered from the packets so the arithmetic runs on plain arrays and
+ * can be vectorized by the compiler.
+ */
+struct cksum_burst {
+  cksum_field_t *fields[MAX_BULK_SIZE * 2]; ///< The checksum fields in packets, ipv4 and tcp/udp of each packet.
+  uint16_t values[MAX_BULK_SIZE * 2]; ///< The checksums before and then after updating.
+  uint16_t deltas[MAX_BULK_SIZE * 2]; ///< The differences to add.
+  uint16_t zero_values[MAX_BULK_SIZE * 2]; ///< The value to replace a zero result, 0xffff for udp and 0 for others.
+  uint16_t count;
+};
+
+/**
+ * Record a checksum of a packet to update.
+ *
+ * @param burst The checksums of current burst.
+ * @param field The checksum field in packet.
+ * @param delta The difference to add.
+ * @param is_udp Whether it is an udp checksum, where zero means no checksum.
+ */
+static inline void cksum_burst_add(struct cksum_burst *burst, cksum_field_t *field, uint16_t delta, bool is_udp) {
+  uint16_t i = burst->count++;
+  burst->fields[i] = field;
+  burst->values[i] = *field;
+  burst->deltas[i] = delta;
+  burst->zero_values[i] = is_udp ? 0xffff : 0;
+}
+
+/**
+ * Update all the recorded checksums by HC' = ~(~HC + ~m + m') of RFC 1624, and write them back to the packets.
+ *
+ * @param burst The checksums of current burst, which is reset after updating.
+ */
+static inline void cksum_burst_update(struct cksum_burst *burst) {
+  uint16_t count = burst->count;
+  for (uint16_t i = 0; i < count; i++) {
+    uint32_t sum = (uint32_t) (uint16_t) ~burst->values[i] + burst->deltas[i];
+    uint16_t value = (uint16_t) ~((sum & 0xffff) + (sum >> 16));
+    burst->values[i] = value == 0 ? burst->zero_values[i] : value;
+  }
+  for (uint16_t i = 0; i < count; i++) {
+    *burst->fields[i] = burst->values[i];
+  }
+  burst->count = 0;
+}
+
+#endif //SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_CHECKSUM_H_
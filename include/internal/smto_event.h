@@ -28,6 +28,7 @@
 #include <rte_alarm.h>
 #include <stdint.h>
 #include "smto.h"
+#include "internal/smto_flow_key.h"
 
 
 #define TIMEOUT_FLOW_BATCH_SIZE 8
@@ -44,6 +45,32 @@
 int query_counter(uint16_t port_id, struct rte_flow *flow, struct rte_flow_query_count *counter,
                   struct rte_flow_error *error);
 
+/**
+ * The totals of a flow, merged from the worker and the rte_flow counters.
+ */
+struct smto_flow_stats {
+  uint64_t packets; ///< The packets of both paths.
+  uint64_t bytes; ///< The bytes of both paths.
+  uint64_t sw_packets; ///< The packets handled by the worker.
+  uint64_t sw_bytes; ///< The bytes handled by the worker.
+  uint64_t hw_packets; ///< The packets forwarded by the nic, including the destroyed rte_flows.
+  uint64_t hw_bytes; ///< The bytes forwarded by the nic, including the destroyed rte_flows.
+};
+
+/**
+ * Get the totals of a flow. The counter of its live rte_flow is queried, so the caller must have claimed the rte_flow
+ * by setting is_offload from OFFLOAD_SUCCESS to OFFLOADING, which keeps the flow engine from destroying it meanwhile.
+ *
+ * @param port_id The port which the rte_flow of the flow key is created on.
+ * @param flow_key The flow key of one direction.
+ * @param stats The result.
+ * @param error The error occur when querying the rte_flow.
+ * @return 0 on success, SMTO_ERROR_FLOW_QUERY if the rte_flow cannot be queried, in which case stats only has the
+ *         counters of the worker and the destroyed rte_flows.
+ */
+int get_flow_stats(uint16_t port_id, struct smto_flow_key *flow_key, struct smto_flow_stats *stats,
+                   struct rte_flow_error *error);
+
 /**
  * Register a callback function to delete the flow which has timeout.
  *
@@ -29,6 +29,18 @@
 #include "smto.h"
 #include "internal/smto_flow_key.h"
 
+/// The max flows dequeued from the flow rules ring of a worker at a time.
+#define FLOW_RULES_BURST_SIZE 5
+
+/**
+ * Besides the flows to offload, the flow rules ring carries the TCP connections to close, whose out-direction flow
+ * keys are tagged by the enum smto_tcp_close stage in the low bits, which are always zero as the keys are cache aligned.
+ */
+#define FLOW_RULE_TAG_MASK ((uintptr_t) (TCP_CLOSE_RULES | TCP_CLOSE_STATE))
+
+/// The max TCP connections waiting for their pending offload or aging to finish before they can be closed.
+#define MAX_PENDING_CLOSES 1024
+
 /**
  * Create a default jump rule which make pkts jump from group 0 to 1.
  *
@@ -54,10 +66,10 @@ struct rte_flow *create_default_jump_flow(uint16_t port_id);
 struct rte_flow *create_default_rss_flow(uint16_t port_id);
 
 /**
- * Create a offload flow which match by a ipv4 5-tuple.
+ * Create a offload flow which match by an ipv4 or ipv6 5-tuple, or by the inner 5-tuple and the VNI of a tunnel.
  *
  * @param port_id The port which the flow will be affect.
- * @param flow_key The ipv4 5-tuple which used to match packet.
+ * @param flow_key The flow key whose 5-tuple is used to match packet.
  * @param error The error return by creating rte_flow.
  * @return
 *      - not NULL: Create success.
@@ -26,7 +26,11 @@
 #define SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_FLOW_KEY_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
 #include <nmmintrin.h>
+#include <rte_common.h>
+#include <rte_atomic.h>
 #include <rdarm.h>
 
 /// Check the instruction support for hash function.
@@ -41,8 +45,8 @@
 #include <rte_jhash.h>
 #endif
 
-/// Used to allocate memory for dumping five tuple.
-#define MAX_PKT_INFO_LENGTH 50
+/// Used to allocate memory for dumping five tuple, which is long enough for ipv6.
+#define MAX_PKT_INFO_LENGTH 128
 
 /// Used to mask useless bits when extract packet info.
 #define ALL_32_BITS 0xffffffff
@@ -50,36 +54,239 @@
 
 typedef __m128i xmm_t;
 
+/// The bits of a VLAN ID.
+#define VLAN_ID_BITS 12
+
+/**
+ * Save a 24-bit scope of flows into the prefix of a tuple in network byte order. The scope of a plain flow is its
+ * VLAN IDs, the single VLAN ID of 802.1Q or the outer VLAN ID in the high 12 bits and the inner one in the low 12
+ * bits of QinQ, and 0 for untagged packets. The scope of a tunneled flow is its VNI.
+ *
+ * @param prefix The prefix of an ipv4 or ipv6 tuple.
+ * @param scope The scope.
+ */
+static inline void set_tuple_scope(void *prefix, uint32_t scope) {
+  uint8_t *bytes = (uint8_t *) prefix;
+  bytes[0] = (uint8_t) (scope >> 16);
+  bytes[1] = (uint8_t) (scope >> 8);
+  bytes[2] = (uint8_t) scope;
+}
+
+/**
+ * Get the 24-bit scope saved by set_tuple_scope().
+ */
+static inline uint32_t get_tuple_scope(const void *prefix) {
+  const uint8_t *bytes = (const uint8_t *) prefix;
+  return (uint32_t) bytes[0] << 16 | (uint32_t) bytes[1] << 8 | bytes[2];
+}
+
+/**
+ * The tunnel which carries a flow. A tunneled flow is identified by the inner ipv4 5-tuple and the 24-bit VNI, which
+ * is saved in the prefix of the tuple, so it shares the ipv4 flow table with the plain flows.
+ */
+enum smto_tunnel_type {
+  SMTO_TUNNEL_NONE = 0,
+  SMTO_TUNNEL_VXLAN,
+  SMTO_TUNNEL_GENEVE,
+  SMTO_TUNNEL_GRE, ///< GRE carrying ipv4, the VNI is the high 24 bits of the GRE key.
+  SMTO_TUNNEL_NVGRE, ///< GRE carrying ethernet, the VNI is the VSID in the GRE key.
+  SMTO_TUNNEL_GRE_NO_KEY, ///< GRE carrying ipv4 without the key, the VNI is 0.
+};
+
 enum offload_status {
   NOT_OFFLOAD = 0,
   OFFLOADING = 1,
   OFFLOAD_SUCCESS = 2,
+  OFFLOAD_CLOSED = 3, ///< The TCP connection is closed, so the flow is never offloaded again.
 };
 
-struct smto_flow_key {
+/**
+ * The stages to close a TCP connection, set on the out-direction flow key by the workers and handed to the flow engine.
+ */
+enum smto_tcp_close {
+  TCP_CLOSE_RULES = 1, ///< Both directions have sent FIN, destroy the rte_flows while the last ACK is still expected.
+  TCP_CLOSE_STATE = 2, ///< Reset or closed, remove the flow state from the flow table after the rte_flows.
+};
+
+/**
+ * The ipv6 5-tuple, which is the key of the ipv6 flow table. The addresses and ports are in network byte order.
+ */
+struct smto_ipv6_tuple {
+  uint8_t ip1[16]; ///< The source address.
+  uint8_t ip2[16]; ///< The destination address.
+  uint16_t port1; ///< The source port.
+  uint16_t port2; ///< The destination port.
+  uint8_t proto;
+  uint8_t prefix[3]; ///< The VLAN IDs, the same as the prefix of the ipv4 tuple.
+};
+
+/**
+ * The rewrite template of an ipv4 flow, which holds everything the worker needs to translate a packet, so it is loaded
+ * by one 16-byte read. The addresses and ports are in network byte order.
+ */
+struct smto_nat_template {
   union {
-    struct rdarm_five_tuple tuple; ///< The tuple to identify a flow.
     struct {
-      uint8_t pad0;
-      uint8_t proto;
-      uint16_t pad1;
-      uint32_t ip_src;
-      uint32_t ip_dst;
-      uint16_t port_src;
-      uint16_t port_dst;
-    }; ///< The struct to load tuple from mbuf.
+      uint32_t ip1; ///< The new source address.
+      uint32_t ip2; ///< The new destination address.
+      uint16_t port1; ///< The new source port.
+      uint16_t port2; ///< The new destination port.
+      uint16_t ipv4_cksum_delta; ///< The ipv4 checksum difference of the rewriting.
+      uint16_t l4_cksum_delta; ///< The tcp/udp checksum difference of the rewriting.
+    };
     xmm_t xmm;
   };
-  struct rdarm_five_tuple modify_tuple;
-  struct rte_flow *flow;
-  volatile uint64_t create_at; ///< Use the number of cycles of CPU as the time.
-  volatile uint32_t flow_size; ///< Total size of packets in this flow.
-  volatile uint32_t packet_amount; ///< Total amount of packets in a flow.
-//  uint16_t new_port;
-  enum offload_status is_offload; ///< Has created rte_flow to offload flow or not
+};
+
+/**
+ * The rewrite template of an ipv6 flow.
+ */
+struct smto_nat6_template {
+  uint8_t ip1[16]; ///< The new source address.
+  uint8_t ip2[16]; ///< The new destination address.
+  uint16_t port1; ///< The new source port.
+  uint16_t port2; ///< The new destination port.
+  uint16_t l4_cksum_delta; ///< The tcp/udp checksum difference of the rewriting.
+};
+
+/**
+ * The packet and byte counters of a flow, which are written by a single thread without atomics. The sequence number is
+ * odd while an update is in progress, so the other threads get consistent totals by read_flow_counter().
+ */
+struct smto_flow_counter {
+  uint32_t seq;
+  uint64_t packets;
+  uint64_t bytes;
+};
+
+/**
+ * Add to the counters, only called by the thread which owns them.
+ */
+static inline void add_flow_counter(struct smto_flow_counter *counter, uint64_t packets, uint64_t bytes) {
+  counter->seq++;
+  rte_smp_wmb();
+  counter->packets += packets;
+  counter->bytes += bytes;
+  rte_smp_wmb();
+  counter->seq++;
+}
+
+/**
+ * Read the counters written by another thread, retry until no update overlaps the reading.
+ */
+static inline void read_flow_counter(const struct smto_flow_counter *counter, uint64_t *packets, uint64_t *bytes) {
+  uint32_t seq;
+  do {
+    seq = __atomic_load_n(&counter->seq, __ATOMIC_ACQUIRE);
+    *packets = __atomic_load_n(&counter->packets, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&counter->bytes, __ATOMIC_RELAXED);
+    rte_smp_rmb();
+  } while ((seq & 1) != 0 || seq != __atomic_load_n(&counter->seq, __ATOMIC_RELAXED));
+}
+
+/**
+ * The flow key of one direction, whose cache lines are split by their writers to keep them from bouncing between
+ * the cores:
+ *  - the rewrite template and the aging links, read by the worker for every packet and only written on creation,
+ *    expiry and removal by the worker which creates the flow;
+ *  - the counters, the timestamp and the TCP state, written by the worker which receives the flow, and by the control
+ *    thread after the rte_flow of an idle flow is destroyed, with the fields only read on removal;
+ *  - the tuple and the control-plane state, written by the flow engine and the aged event thread with atomics.
+ *
+ * Bytes per flow, both directions are one object of the flow key pool with a cache-aligned header and padded to
+ * spread over the default 4 memory channels: 144 bytes per key, 288 per pair and 448 per object before the split,
+ * 192 bytes per key, 384 per pair and still 448 per object after it.
+ */
+struct smto_flow_key {
+  union {
+    struct smto_nat_template modify_tuple; ///< The rewrite template of an ipv4 flow.
+    struct smto_nat6_template modify_tuple6; ///< The rewrite template of an ipv6 flow.
+  };
   struct smto_flow_key *symmetrical_flow_key;
+  union {
+    struct smto_flow_key *aging_next; ///< On the out-direction key, the next flow in the same slot of the aging wheel.
+    struct smto_flow_key **aging_pprev; ///< On the in-direction key, the link pointing to the out-direction key.
+  };
+
+  struct smto_flow_counter sw_counter __rte_cache_aligned; ///< The packets handled by the worker.
+  uint64_t hw_packets; ///< The packets of the destroyed rte_flows, only accessed by the control thread.
+  uint64_t hw_bytes; ///< The bytes of the destroyed rte_flows, only accessed by the control thread.
+  uint64_t create_at; ///< Use the number of cycles of CPU as the time.
+  uint8_t tcp_flags; ///< The TCP flags seen in this direction, only written by the worker which receives it.
+  uint8_t tcp_close; ///< The enum smto_tcp_close stages requested, only on the out-direction key, set by atomics.
+  uint32_t last_seen; ///< The aging tick of the last packet in this direction, written by the worker which receives it.
+  uint16_t worker_id; ///< The packet worker which creates this flow, used to find the flow table shard.
+  uint16_t snat_index; ///< The index in the SNAT pool of the translated source address of an ipv4 flow.
+
+  struct rte_flow *flow __rte_cache_aligned; ///< Published before is_offload is set to OFFLOAD_SUCCESS.
+  enum offload_status is_offload; ///< Has created rte_flow to offload flow or not, accessed by __atomic builtins.
+  bool is_ipv6; ///< Which tuples are used.
+  uint8_t tunnel_type; ///< The enum smto_tunnel_type, the inner flow is not translated if carried by a tunnel.
+  uint8_t vlan_depth; ///< The quantity of VLAN tags, 0 to 2, whose VLAN IDs are saved in the prefix of the tuple.
+  /// Both share the last byte before the tuple and are only written by the flow engine.
+  uint8_t rule_port_index: 4; ///< The index in the ports of the port which the rte_flow is created on.
+  uint8_t tcp_close_done: 4; ///< The enum smto_tcp_close stages finished, only on the out-direction key.
+  union {
+    union {
+      struct rdarm_five_tuple tuple; ///< The tuple to identify a flow.
+      struct {
+        uint8_t pad0;
+        uint8_t proto;
+        uint16_t pad1;
+        uint32_t ip_src;
+        uint32_t ip_dst;
+        uint16_t port_src;
+        uint16_t port_dst;
+      }; ///< The struct to load tuple from mbuf.
+      xmm_t xmm;
+    }; ///< The tuple of an ipv4 flow.
+    struct smto_ipv6_tuple tuple6; ///< The tuple of an ipv6 flow.
+  };
+};
+
+/**
+ * Initialize the rewrite template of an ipv4 flow to keep the tuple unchanged.
+ */
+static inline void init_nat_template(struct smto_nat_template *nat, const struct rdarm_five_tuple *tuple) {
+  nat->ip1 = tuple->ip1;
+  nat->ip2 = tuple->ip2;
+  nat->port1 = tuple->port1;
+  nat->port2 = tuple->port2;
+  nat->ipv4_cksum_delta = 0;
+  nat->l4_cksum_delta = 0;
+}
+
+/**
+ * Initialize the rewrite template of an ipv6 flow to keep the tuple unchanged.
+ */
+static inline void init_nat6_template(struct smto_nat6_template *nat6, const struct smto_ipv6_tuple *tuple6) {
+  memcpy(nat6->ip1, tuple6->ip1, sizeof(nat6->ip1));
+  memcpy(nat6->ip2, tuple6->ip2, sizeof(nat6->ip2));
+  nat6->port1 = tuple6->port1;
+  nat6->port2 = tuple6->port2;
+  nat6->l4_cksum_delta = 0;
+}
+
+/**
+ * The flow keys of both directions of a flow, which are allocated from the flow key pool as one object.
+ */
+struct smto_flow_key_pair {
+  struct smto_flow_key out; ///< The out-direction flow key, the one created by the first packet.
+  struct smto_flow_key in; ///< The in-direction flow key.
 };
 
+/**
+ * Get the pair which the flow key belongs to.
+ *
+ * @param flow_key The flow key of any direction.
+ * @return The object allocated from the flow key pool.
+ */
+static inline struct smto_flow_key_pair *get_flow_key_pair(struct smto_flow_key *flow_key) {
+  /// The out-direction flow key is always the first one of a pair
+  return (struct smto_flow_key_pair *) (flow_key < flow_key->symmetrical_flow_key ? flow_key
+                                                                                  : flow_key->symmetrical_flow_key);
+}
+
 /**
  * Return a format string of ipv4 5-tuple.
  *
@@ -91,4 +298,33 @@ struct smto_flow_key {
  */
 void dump_pkt_info(struct rdarm_five_tuple *key, uint16_t port_id, int qi, char *result, int result_length);
 
+/**
+ * Return a format string of ipv6 5-tuple.
+ *
+ * @param key The key want to print.
+ * @param port_id The port id of this pkt.
+ * @param qi The id of queue, negative means ignore.
+ * @param result The result string.
+ * @param result_size The max length of result string.
+ */
+void dump_ipv6_pkt_info(struct smto_ipv6_tuple *key, uint16_t port_id, int qi, char *result, int result_length);
+
+/**
+ * Return a format string of the tuple of a flow key, either ipv4 or ipv6.
+ *
+ * @param flow_key The flow key want to print.
+ * @param port_id The port id of this flow.
+ * @param qi The id of queue, negative means ignore.
+ * @param result The result string.
+ * @param result_size The max length of result string.
+ */
+static inline void dump_flow_key_info(struct smto_flow_key *flow_key, uint16_t port_id, int qi,
+                                      char *result, int result_length) {
+  if (flow_key->is_ipv6) {
+    dump_ipv6_pkt_info(&flow_key->tuple6, port_id, qi, result, result_length);
+  } else {
+    dump_pkt_info(&flow_key->tuple, port_id, qi, result, result_length);
+  }
+}
+
 #endif //SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_FLOW_KEY_H_
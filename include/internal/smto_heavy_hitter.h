@@ -0,0 +1,109 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2022 Chenming C (ccm@ccm.ink)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+#ifndef SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_HEAVY_HITTER_H_
+#define SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_HEAVY_HITTER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <rte_common.h>
+#include <rte_ring.h>
+#include <rte_hash.h>
+
+#define HH_SKETCH_DEPTH 4 ///< The rows of the count-min sketch, each with its own hash.
+#define HH_SKETCH_WIDTH_BITS 10
+#define HH_SKETCH_WIDTH (1 << HH_SKETCH_WIDTH_BITS) ///< The counters of each row.
+#define HH_WINDOW_US 100000 ///< The counters are halved every window, 100ms.
+#define HH_BYTES_THRESHOLD (64 * 1024) ///< The bytes a flow is projected to carry to justify a hardware rule.
+#define HH_BACKLOG_WEIGHT 8 ///< The threshold is raised to (1 + weight) times when the flow rules ring is full.
+
+/**
+ * A count-min sketch of the packets and bytes of the flows seen by a worker in a sliding window, which is approximated
+ * by halving all the counters at the end of each window. A flow is a heavy hitter if the bytes estimated in the window
+ * exceed the threshold. As the flow sizes are heavy tailed, the volume a flow has carried recently is also a fair
+ * projection of what it will carry in the future.
+ *
+ * The sketch of 32KB is only touched by its worker, and stays in the L2 cache.
+ */
+struct smto_heavy_hitter {
+  uint64_t window_start; ///< The TSC cycle when the current window starts.
+  uint32_t bytes_threshold; ///< The bytes to nominate a flow, which adapts to the backlog of the flow engine.
+  uint32_t packets[HH_SKETCH_DEPTH][HH_SKETCH_WIDTH];
+  uint32_t bytes[HH_SKETCH_DEPTH][HH_SKETCH_WIDTH];
+};
+
+/// The odd multipliers to derive the independent index of each row from the hash signature of a flow.
+static const uint32_t HH_SKETCH_SEEDS[HH_SKETCH_DEPTH] = {0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f};
+
+/**
+ * Count a packet into the sketch and estimate the packets and bytes of its flow in the window, which are the minimum
+ * counters of all the rows, so the hash collisions can only overestimate a flow.
+ *
+ * @param hh The sketch of the worker.
+ * @param sig The hash signature of the flow, which has been computed by the flow table lookup.
+ * @param pkt_len The length of the packet.
+ * @param packets Output the estimated packets of the flow.
+ *
+ * @return The estimated bytes of the flow.
+ */
+static inline uint32_t heavy_hitter_update(struct smto_heavy_hitter *hh, hash_sig_t sig, uint32_t pkt_len,
+                                           uint32_t *packets) {
+  uint32_t min_packets = UINT32_MAX, min_bytes = UINT32_MAX;
+  for (int i = 0; i < HH_SKETCH_DEPTH; i++) {
+    uint32_t index = (sig * HH_SKETCH_SEEDS[i]) >> (32 - HH_SKETCH_WIDTH_BITS);
+    uint32_t row_packets = ++hh->packets[i][index];
+    uint32_t row_bytes = hh->bytes[i][index] += pkt_len;
+    min_packets = RTE_MIN(min_packets, row_packets);
+    min_bytes = RTE_MIN(min_bytes, row_bytes);
+  }
+  *packets = min_packets;
+  return min_bytes;
+}
+
+/**
+ * Start a new window if the current one has ended. Halve all the counters, so the earlier windows weigh less, and
+ * adapt the threshold to the backlog of flow rules this worker has handed to the flow engine.
+ *
+ * @param hh The sketch of the worker.
+ * @param flow_rules_ring The flow rules ring of the worker.
+ * @param now The current TSC cycle.
+ * @param window_tsc The TSC cycles of a window.
+ */
+static inline void heavy_hitter_advance(struct smto_heavy_hitter *hh, struct rte_ring *flow_rules_ring,
+                                        uint64_t now, uint64_t window_tsc) {
+  if (likely(now - hh->window_start < window_tsc)) {
+    return;
+  }
+  hh->window_start = now;
+  for (int i = 0; i < HH_SKETCH_DEPTH; i++) {
+    for (int j = 0; j < HH_SKETCH_WIDTH; j++) {
+      hh->packets[i][j] >>= 1;
+      hh->bytes[i][j] >>= 1;
+    }
+  }
+  unsigned int backlog = rte_ring_count(flow_rules_ring);
+  hh->bytes_threshold = HH_BYTES_THRESHOLD
+      + (uint64_t) HH_BYTES_THRESHOLD * HH_BACKLOG_WEIGHT * backlog / rte_ring_get_capacity(flow_rules_ring);
+}
+
+#endif //SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_HEAVY_HITTER_H_
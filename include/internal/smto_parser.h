@@ -0,0 +1,88 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2022 Chenming C (ccm@ccm.ink)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#ifndef SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_PARSER_H_
+#define SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_PARSER_H_
+
+#include <stdint.h>
+#include <rte_mbuf.h>
+#include "smto.h"
+#include "internal/smto_flow_key.h"
+
+/**
+ * The kernel to extract the ipv4 5-tuples of a burst.
+ *
+ * @param mbufs The packets of a burst.
+ * @param nb_pkts The quantity of packets.
+ * @param tuples The extracted tuples of the supported packets, must be able to hold nb_pkts tuples.
+ * @param pkt_indexes The index of mbuf which each extracted tuple belongs to.
+ * @return The quantity of extracted tuples.
+ */
+typedef uint16_t (*extract_tuples_t)(struct rte_mbuf **mbufs,
+                                     uint16_t nb_pkts,
+                                     struct smto_flow_key *tuples,
+                                     uint16_t *pkt_indexes);
+
+/// The kernel selected by init_parser(), use SSE by default.
+extern extract_tuples_t extract_ipv4_tuples;
+
+/**
+ * Extract the ipv6 5-tuples of a burst, the addresses are copied by SSE. The packets with extension headers are not
+ * supported. The headers should have been prefetched by extract_ipv4_tuples().
+ *
+ * @param mbufs The packets of a burst.
+ * @param nb_pkts The quantity of packets.
+ * @param tuples The extracted tuples of the ipv6 packets, must be able to hold nb_pkts tuples.
+ * @param pkt_indexes The index of mbuf which each extracted tuple belongs to.
+ * @return The quantity of extracted tuples.
+ */
+uint16_t extract_ipv6_tuples(struct rte_mbuf **mbufs,
+                             uint16_t nb_pkts,
+                             struct smto_flow_key *tuples,
+                             uint16_t *pkt_indexes);
+
+/**
+ * Extract the inner ipv4 5-tuples of the GRE and NVGRE packets of a burst, the VNI is taken from the high 24 bits of
+ * the GRE key, which is the VSID of NVGRE, or 0 for GRE without the key. The VXLAN and GENEVE packets are classified
+ * by extract_ipv4_tuples() already.
+ *
+ * @param mbufs The packets of a burst.
+ * @param nb_pkts The quantity of packets.
+ * @param tuples The extracted inner tuples, must be able to hold nb_pkts tuples.
+ * @param pkt_indexes The index of mbuf which each extracted tuple belongs to.
+ * @return The quantity of extracted tuples.
+ */
+uint16_t extract_gre_tuples(struct rte_mbuf **mbufs,
+                            uint16_t nb_pkts,
+                            struct smto_flow_key *tuples,
+                            uint16_t *pkt_indexes);
+
+/**
+ * Select the fastest tuple extracting kernel which is supported by the running cpu.
+ *
+ * @param logger The logger to print the selected kernel.
+ */
+void init_parser(zlog_category_t *logger);
+
+#endif //SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_PARSER_H_
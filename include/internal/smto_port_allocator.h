@@ -0,0 +1,164 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2022 Chenming C (ccm@ccm.ink)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+#ifndef SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_PORT_ALLOCATOR_H_
+#define SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_PORT_ALLOCATOR_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <rte_common.h>
+#include <rte_byteorder.h>
+#include <rte_hash.h>
+
+/// The range of the ports to translate the flows to, the well-known ports are never used.
+#define NAT_PORT_MIN 1024
+#define NAT_PORT_MAX 65535
+
+#define NAT_PORT_WORDS ((NAT_PORT_MAX + 1) / 64) ///< A bit for each port.
+#define NAT_PORT_SUMMARY_WORDS (NAT_PORT_WORDS / 64) ///< A bit for each word of ports.
+/// The max lookups to find a port by endpoint-dependent mapping, which is only reached when over 99% are used.
+#define NAT_PORT_MAX_PROBES 1024
+
+/**
+ * The free NAT ports of a source address in a two-level bitmap. Each packet worker owns a disjoint slice of the ports,
+ * and allocates and releases them without any synchronization, as the flows are always removed by the worker which
+ * creates them. An allocation checks at most 17 summary words, and a release sets two bits.
+ *
+ * It takes 8KB for the whole port space, so the initialization only sets about a thousand words.
+ */
+struct smto_port_allocator {
+  uint64_t summary[NAT_PORT_SUMMARY_WORDS]; ///< Bit i of summary[j] is set if words[j * 64 + i] has any free port.
+  uint64_t words[NAT_PORT_WORDS]; ///< Bit i of words[j] is set if port j * 64 + i is free.
+  uint32_t cursor; ///< The word to start the next allocation.
+  uint32_t free_ports; ///< The quantity of free ports.
+};
+
+/**
+ * Initialize the allocator with the ports in [first_port, last_port] free.
+ */
+static inline void init_port_allocator(struct smto_port_allocator *allocator, uint16_t first_port, uint16_t last_port) {
+  memset(allocator, 0, sizeof(struct smto_port_allocator));
+  for (uint32_t port = first_port; port <= last_port;) {
+    uint32_t word = port / 64, bit = port % 64;
+    uint32_t quantity = RTE_MIN(64 - bit, (uint32_t) last_port - port + 1);
+    allocator->words[word] |= (quantity == 64 ? UINT64_MAX : (1ULL << quantity) - 1) << bit;
+    allocator->summary[word / 64] |= 1ULL << (word % 64);
+    allocator->free_ports += quantity;
+    port += quantity;
+  }
+  allocator->cursor = first_port / 64;
+}
+
+/**
+ * Allocate a free port. The search starts from the word after the last allocation, so a released port is not reused
+ * right away while the peer may still keep the old connection in TIME_WAIT.
+ *
+ * @return The port in host byte order, or 0 if all the ports are used.
+ */
+static inline uint16_t alloc_nat_port(struct smto_port_allocator *allocator) {
+  uint32_t word = allocator->cursor;
+  for (uint32_t i = 0; i <= NAT_PORT_SUMMARY_WORDS; i++) {
+    uint32_t index = (word / 64) % NAT_PORT_SUMMARY_WORDS;
+    /// Skip the words before the cursor at first, they are checked at last after wrapping around
+    uint64_t candidates = allocator->summary[index] & (UINT64_MAX << (word % 64));
+    if (candidates != 0) {
+      word = index * 64 + __builtin_ctzll(candidates);
+      uint16_t port = word * 64 + __builtin_ctzll(allocator->words[word]);
+      allocator->words[word] &= allocator->words[word] - 1;
+      if (allocator->words[word] == 0) {
+        allocator->summary[index] &= ~(1ULL << (word % 64));
+      }
+      allocator->cursor = (word + 1) % NAT_PORT_WORDS;
+      allocator->free_ports--;
+      return port;
+    }
+    word = (index + 1) * 64;
+  }
+  return 0;
+}
+
+/**
+ * Release a port allocated from the allocator.
+ *
+ * @param port The port in host byte order.
+ */
+static inline void free_nat_port(struct smto_port_allocator *allocator, uint16_t port) {
+  uint32_t word = port / 64;
+  allocator->words[word] |= 1ULL << (port % 64);
+  allocator->summary[word / 64] |= 1ULL << (word % 64);
+  allocator->free_ports++;
+}
+
+/**
+ * Find a NAT port by endpoint-dependent mapping, where the flows towards different peers share the same source address
+ * and port. A port is free for a flow if the flow table has no in-direction key with it, which is the reply tuple of
+ * the flow with the port as the destination port, so no free list is kept and nothing is released when the flow is
+ * removed.
+ *
+ * The ports are probed by double hashing on the hash of the flow: the start and the stride both come from it, and the
+ * stride is coprime with the slice, so every port is visited once. The probes of the flows towards the same peer do
+ * not cluster as linear probing does, which takes about 1 / (1 - occupancy) lookups on average.
+ *
+ * The in-direction keys with ports in the slice are only added by the worker owning the slice, so the port stays free
+ * until the worker adds the key.
+ *
+ * @param flow_hash_map The flow table holding the in-direction keys of the worker.
+ * @param reply The in-direction tuple of the flow, whose destination port is overwritten by the candidates.
+ * @param reply_port The destination port in the reply tuple.
+ * @param first_port The first port of the slice of the worker.
+ * @param last_port The last port of the slice of the worker.
+ * @param sig The hash signature of the flow.
+ *
+ * @return The port in host byte order, or 0 if no free port is found in NAT_PORT_MAX_PROBES lookups.
+ */
+static inline uint16_t probe_nat_port(const struct rte_hash *flow_hash_map, const void *reply, uint16_t *reply_port,
+                                      uint16_t first_port, uint16_t last_port, uint32_t sig) {
+  uint32_t slice = (uint32_t) last_port - first_port + 1;
+  uint32_t offset = sig % slice;
+  uint32_t stride = slice == 1 ? 1 : 1 + (sig >> 16) % (slice - 1);
+  /// Move to the next stride until it is coprime with the slice, which takes a few steps at most
+  for (;; stride = stride % (slice - 1) + 1) {
+    uint32_t a = slice, b = stride;
+    while (b != 0) {
+      uint32_t r = a % b;
+      a = b;
+      b = r;
+    }
+    if (a == 1) {
+      break;
+    }
+  }
+  for (uint32_t i = 0; i < RTE_MIN(slice, (uint32_t) NAT_PORT_MAX_PROBES); i++) {
+    *reply_port = rte_cpu_to_be_16((uint16_t) (first_port + offset));
+    if (rte_hash_lookup(flow_hash_map, reply) == -ENOENT) {
+      return (uint16_t) (first_port + offset);
+    }
+    offset += stride;
+    if (offset >= slice) {
+      offset -= slice;
+    }
+  }
+  return 0;
+}
+
+#endif //SMART_OFFLOAD_INCLUDE_INTERNAL_SMTO_PORT_ALLOCATOR_H_
@@ -40,6 +40,24 @@
  */
 int assert_link_status(uint16_t port_id);
 
+/**
+ * Get the max quantity of rx/tx queues which can be used by workers, one queue is reserved for hairpin.
+ *
+ * @param port_id The port to be checked.
+ *
+ * @return The quantity of queues, 0 on error.
+ */
+uint16_t get_max_queue_quantity(uint16_t port_id);
+
+/**
+ * Check whether the port can compute the ipv4, tcp and udp checksums on tx.
+ *
+ * @param port_id The port to be checked.
+ *
+ * @return true if all of them can be offloaded.
+ */
+bool has_tx_cksum_offload(uint16_t port_id);
+
 /**
  * Configure a network port and initialize the rx/tx queues.
  *
@@ -61,10 +79,51 @@ int setup_one_port_hairpin(int port_id);
 int setup_two_port_hairpin(int port_id, int peer_port_id);
 
 /**
- * Free the memory of flows in the hash map and free the flow hash map.
+ * Create the ipv4 and ipv6 flow hash maps, each is one shared table or one single-writer shard for each packet worker.
+ *
+ * @return 0 on success, other on error.
+ */
+int create_hash_map();
+
+/**
+ * Free the memory of flows in the hash map, free the flow hash map with its RCU and the flow key pool. Only called
+ * after the packet workers have exited.
  *
  * @return 0 on success, other on error.
  */
 int destroy_hash_map();
 
+/**
+ * Create one single-producer/single-consumer flow rules ring for each packet worker, from the worker to the flow
+ * engine, and one flow teardown ring back to the worker. packet_worker_quantity should have been set.
+ *
+ * @return 0 on success, other on error.
+ */
+int create_flow_rules_rings();
+
+/**
+ * Free the flow rules rings and the flow teardown rings.
+ */
+void destroy_flow_rules_rings();
+
+/**
+ * Parse the SNAT pool into the addresses to translate the ipv4 flows to.
+ *
+ * @param pool A comma-separated list of addresses or CIDR prefixes, such as "5.1.1.0/24,6.1.1.1".
+ *
+ * @return 0 on success, SMTO_ERROR_INVALID_SNAT_POOL if it cannot be parsed or has more than MAX_SNAT_IPS addresses.
+ */
+int init_snat_pool(const char *pool);
+
+/**
+ * Assign the slice of NAT ports to a packet worker, and create its NAT port allocators, one for each address of the
+ * SNAT pool, and one for SRC_IP6 at last. Each one only holds the slice of ports owned by the worker.
+ *
+ * @param worker The packet worker whose worker_id is set, the allocators are freed by rte_free().
+ * @param socket_id The socket to allocate memory on.
+ *
+ * @return 0 on success, SMTO_ERROR_MEMORY_ALLOCATION on error.
+ */
+int create_port_allocators(struct worker_parameter *worker, int socket_id);
+
 #endif //SMART_OFFLOAD_SRC_SMTO_PORT_H_
@@ -27,16 +27,55 @@
 
 #include <zlog.h>
 #include <rte_lcore.h>
+#include <rte_hash.h>
+#include <rte_ring.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include "internal/smto_flow_key.h"
+#include "internal/smto_port_allocator.h"
+#include "internal/smto_aging.h"
+#ifdef HEAVY_HITTER_OFFLOAD
+#include "internal/smto_heavy_hitter.h"
+#endif
 
 
 /**
  * Used to pass parameters to the worker.
  */
 struct worker_parameter {
+  uint16_t worker_id; ///< The index of packet worker, which is also the index of its flow table shard.
   uint16_t queue_id;
   uint16_t port_id;
-};
+  unsigned lcore_id; ///< The lcore which runs this worker.
+  struct rte_hash *flow_hash_map; ///< The flow table used by this worker, which is shared if not sharded.
+  struct rte_hash *flow6_hash_map; ///< The ipv6 flow table used by this worker.
+  struct rte_ring *flow_rules_ring; ///< The ring of flows to offload, only this worker enqueues into it.
+  struct rte_ring *flow_teardown_ring; ///< The ring of closed flows handed back by the flow engine to remove.
+  bool rx_intr_enabled; ///< Whether the worker can wait for the rx interrupt when idle, or sleep instead.
+  bool sw_cksum; ///< Whether the checksums are updated by software, as the port cannot offload them.
+  uint16_t nb_offload_candidates; ///< The quantity of flows to offload which are collected in the current burst.
+  struct smto_flow_key *offload_candidates[MAX_BULK_SIZE]; ///< Enqueued to the flow engine once per burst.
+  uint16_t nb_closing_flows; ///< The quantity of TCP connections to close which are collected in the current burst.
+  void *closing_flows[MAX_BULK_SIZE]; ///< The out-direction keys tagged by the enum smto_tcp_close stage.
+  /// Only written by the worker itself, kept in its own cache line to avoid false sharing with the others.
+  volatile uint64_t busy_cycles __rte_cache_aligned; ///< TSC cycles spent on the bursts with packets.
+  volatile uint64_t idle_cycles; ///< TSC cycles spent on the empty polls and waiting.
+  volatile uint64_t idle_waits; ///< The times of backing off from busy polling.
+  volatile uint64_t tx_retries; ///< The times of resending packets rejected by a full tx ring.
+  volatile uint64_t tx_dropped; ///< The packets dropped after all the retries.
+  volatile uint64_t offload_enqueued; ///< The flows handed to the flow engine.
+  volatile uint64_t offload_deferred; ///< The flows left for a later packet as the flow rules ring is full.
+  volatile uint64_t flows_closed; ///< The TCP connections removed on FIN or RST before aging.
+  volatile uint64_t flows_aged; ///< The flows removed after being idle in software.
+  /// The slices of NAT ports, one for each address of the SNAT pool, followed by the one of SRC_IP6.
+  struct smto_port_allocator *port_allocators;
+  uint16_t nat_port_first; ///< The first NAT port of the slice of the worker.
+  uint16_t nat_port_last; ///< The last NAT port of the slice of the worker.
+  struct smto_aging_wheel aging_wheel __rte_cache_aligned; ///< The flows created by the worker by their expiration.
+#ifdef HEAVY_HITTER_OFFLOAD
+  struct smto_heavy_hitter heavy_hitter __rte_cache_aligned; ///< The sketch to pick the flows worth offloading.
+#endif
+} __rte_cache_aligned;
 
 /**
  * Run on the packet worker core to pull packets from rx queues.
@@ -44,4 +83,13 @@ struct worker_parameter {
  */
 int process_loop(void *args);
 
+/**
+ * Get the share of time a packet worker spends on bursts with packets.
+ *
+ * @param worker The parameter of the packet worker.
+ *
+ * @return The busy ratio between 0 and 1.
+ */
+double get_busy_ratio(const struct worker_parameter *worker);
+
 #endif //SMART_OFFLOAD_SRC_SMTO_WORKER_H_
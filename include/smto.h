@@ -32,10 +32,10 @@
 #include <rte_ethdev.h>
 #include <rte_hash.h>
 #include <rte_ring.h>
+#include <rte_rcu_qsbr.h>
 #include <rdarm.h>
 
 #include "smto_comon.h"
-#include "internal/smto_worker.h"
 
 /// The number of elements in the mbuf pool. The optimum size is (2^q - 1). Each mbuf is 2176 bytes.
 #define NUM_MBUFS 1048575
@@ -43,11 +43,8 @@
 /// Size of the per-core object cache. Must lower or equal to RTE_MEMPOOL_CACHE_MAX_SIZE and n / 1.5
 #define CACHE_SIZE 512
 
-/// The quantity of rx/tx queues.
-#define GENERAL_QUEUES_QUANTITY 1
-
-/// The index of hairpin queue.
-#define HAIRPIN_QUEUE_INDEX GENERAL_QUEUES_QUANTITY
+/// The max quantity of rx/tx queues of each port, the actual quantity is derived from the workers and the device.
+#define MAX_QUEUES_QUANTITY 16
 
 /// The packet descriptor of each queue.
 #define QUEUE_DESC_NUMBER 128
@@ -55,19 +52,121 @@
 /// The max flow key of the hash flow table.
 #define MAX_HASH_ENTRIES (1024 * 1024 * 32)
 
+/// The max flow key of the ipv6 flow table.
+#define MAX_HASH6_ENTRIES (1024 * 1024 * 8)
+
+/// The max concurrent flows, each one takes a flow key pair of about 448 bytes of hugepages at startup.
+#ifndef MAX_FLOWS
+#define MAX_FLOWS (1024 * 1024 - 1)
+#endif
+
+/// The number of flow key pairs in the flow key pool, each flow uses two entries of the flow table. The optimum size is (2^q - 1).
+#define FLOW_KEY_POOL_SIZE RTE_MIN(MAX_FLOWS, MAX_HASH_ENTRIES / 2 - 1)
+
+/// The deleted flow keys waiting in the defer queue of a flow table to start reclaiming them after the grace period.
+#define FLOW_RECLAIM_THRESHOLD 256
+
+/// The max deleted flow keys reclaimed at once, which bounds the time spent by a deletion.
+#define FLOW_RECLAIM_MAX 64
+
 /// The max bulk amount to pull from queue.
 #define MAX_BULK_SIZE 32
 
+/// The max amount of packets buffered before a tx burst, so several small rx bursts share one tx doorbell.
+#define TX_BUFFER_SIZE (MAX_BULK_SIZE * 2)
+
+/// The max microseconds a packet stays in the tx buffer.
+#define TX_DRAIN_US 20
+
+/// The times to resend the packets rejected by a full tx ring before dropping them.
+#define TX_RETRY_TIMES 4
+
+/// The distance (in packets) to prefetch packet headers and flow states ahead of the processing one.
+#ifndef PREFETCH_OFFSET
+#define PREFETCH_OFFSET 4
+#endif
+
+/// The amount of continuous empty polls before a worker backs off from busy polling when ADAPTIVE_POLL is defined.
+#ifndef IDLE_POLL_THRESHOLD
+#define IDLE_POLL_THRESHOLD 1024
+#endif
+
+/// The max milliseconds to wait for the rx interrupt, so that the worker can still notice the stop.
+#define IDLE_INTR_TIMEOUT_MS 10
+
+/// The microseconds to sleep when the rx interrupt is not supported by the device.
+#define IDLE_SLEEP_US 10
+
+/// The amount of packets to average the processing time when WORKER_BENCHMARK is defined.
+#define WORKER_BENCHMARK_PACKETS (1024 * 1024)
+
 /// The max amount of ring to transfer flow rules.
 #define MAX_RING_ENTRIES (1024*16)
 
-/// The amount of packets to create a flow rule.
+/// The initial amount of packets to create a flow rule, which is adjusted by the flow engine at runtime.
 #define PKT_AMOUNT_TO_OFFLOAD (5)
 
+/// The bounds of the amount of packets to create a flow rule.
+#define OFFLOAD_THRESHOLD_MIN 2
+#define OFFLOAD_THRESHOLD_MAX 4096
+
+/// The rules the NIC can hold for the offloaded flows, each offloaded flow takes two rules.
+#ifndef NIC_RULE_CAPACITY
+#define NIC_RULE_CAPACITY (1024 * 512)
+#endif
+
+/// The microseconds between two adjustments of the offload threshold.
+#define OFFLOAD_CONTROL_US 10000
+
+/// The max microseconds the flow engine may take to drain the flow rules rings before the offload threshold is raised.
+#define OFFLOAD_BACKLOG_US 20000
+
 /// The seconds to timeout
 #define FLOW_TIMEOUT_SECOND 10
 
-extern const uint32_t SRC_IP;
+/// The source addresses of translated ipv4 flows, a comma-separated list of addresses or CIDR prefixes.
+#ifndef SNAT_POOL
+#define SNAT_POOL "5.1.1.1"
+#endif
+
+/// The max addresses and prefixes in the SNAT pool.
+#define MAX_SNAT_IPS 256
+#define MAX_SNAT_PREFIXES 16
+
+/// Included after the sizes above, which are used by the worker parameter.
+#include "internal/smto_worker.h"
+
+/// The source address of translated ipv6 flows.
+extern const uint8_t SRC_IP6[16];
+
+/**
+ * Get the flow table which contains the flow.
+ *
+ * @param smto_cb The main control block of SmartOffload.
+ * @param worker_id The packet worker which creates the flow.
+ */
+#define GET_FLOW_HASH_MAP(smto_cb, worker_id) \
+  ((smto_cb)->flow_hash_maps[(smto_cb)->flow_table_sharded ? (worker_id) : 0])
+
+/**
+ * Get the ipv6 flow table which contains the flow.
+ *
+ * @param smto_cb The main control block of SmartOffload.
+ * @param worker_id The packet worker which creates the flow.
+ */
+#define GET_FLOW6_HASH_MAP(smto_cb, worker_id) \
+  ((smto_cb)->flow6_hash_maps[(smto_cb)->flow_table_sharded ? (worker_id) : 0])
+
+/// A prefix of the SNAT pool, whose addresses are all used.
+struct smto_snat_prefix {
+  uint32_t ip; ///< The first address in host byte order.
+  uint8_t depth; ///< The length of the prefix, 32 for a single address.
+};
+
+/// The QSBR thread ids of the flow engine and the aged event thread, after the ones of the packet workers.
+#define FLOW_ENGINE_RCU_ID(smto_cb) ((smto_cb)->packet_worker_quantity)
+#define AGED_EVENT_RCU_ID(smto_cb) ((smto_cb)->packet_worker_quantity + 1)
+#define FLOW_TABLE_RCU_THREADS(smto_cb) ((smto_cb)->packet_worker_quantity + 2)
 
 /// The main control block of SmartOffload.
 struct smto {
@@ -75,10 +174,28 @@ struct smto {
   zlog_category_t *logger;
   enum smto_mode mode;
   uint16_t ports[2];
+  uint16_t queue_quantity; ///< The quantity of rx/tx queues of each port, which is also the index of hairpin queue.
   struct rte_mempool *pkt_mbuf_pool;
-  struct rte_hash *flow_hash_map;
-  struct rte_ring *flow_rules_ring;
-  struct rte_ring *port_pool;
+  bool flow_table_sharded; ///< Whether each packet worker owns a single-writer shard of the flow table.
+  uint16_t flow_hash_map_quantity;
+  struct rte_hash *flow_hash_maps[MAX_QUEUES_QUANTITY]; ///< The flow table, only the first one is used if not sharded.
+  struct rte_hash *flow6_hash_maps[MAX_QUEUES_QUANTITY]; ///< The ipv6 flow table, sharded in the same way.
+  struct rte_mempool *flow_key_pool; ///< The pool of struct smto_flow_key_pair.
+  /// The QSBR variable of the flow tables, which each packet worker reports its quiescent state to once per burst,
+  /// and the flow engine and the aged event thread also report to as they hold the flow keys.
+  struct rte_rcu_qsbr *flow_table_rcu;
+  /// The single-producer/single-consumer rings of flows to offload, one for each packet worker.
+  struct rte_ring *flow_rules_rings[MAX_QUEUES_QUANTITY * 2];
+  /// The rings of closed flows from the flow engine back to each packet worker.
+  struct rte_ring *flow_teardown_rings[MAX_QUEUES_QUANTITY * 2];
+  uint16_t snat_ip_quantity;
+  uint32_t snat_ips[MAX_SNAT_IPS]; ///< The source addresses of translated ipv4 flows, in host byte order.
+  uint16_t snat_prefix_quantity;
+  struct smto_snat_prefix snat_prefixes[MAX_SNAT_PREFIXES]; ///< The prefixes of the SNAT pool as configured.
+  uint16_t packet_worker_quantity;
+  volatile uint32_t offload_threshold; ///< The amount of packets to create a flow rule, adjusted by the flow engine.
+  volatile uint32_t installed_rules; ///< The offload rules in the NIC, added by the flow engine and removed on aging.
+  volatile uint64_t insert_cycles; ///< The moving average of TSC cycles the flow engine takes to create a rule.
 };
 
 
@@ -92,6 +209,59 @@ struct smto {
  */
 int init_smto(struct smto **smto_cb);
 
+/// The statistics of a packet worker.
+struct smto_worker_stats {
+  double busy_ratio; ///< The share of time spent on processing packets.
+  uint64_t idle_waits; ///< The times of backing off from busy polling.
+  uint64_t tx_retries; ///< The times of resending packets rejected by a full tx ring.
+  uint64_t tx_dropped; ///< The packets dropped after all the retries.
+  uint64_t offload_enqueued; ///< The flows handed to the flow engine.
+  uint64_t offload_deferred; ///< The flows left for a later packet as the flow rules ring is full.
+  unsigned int offload_ring_count; ///< The flows waiting in the flow rules ring of the worker.
+  uint64_t flows_closed; ///< The TCP connections removed on FIN or RST before aging.
+  uint64_t flows_aged; ///< The flows removed after being idle in software for FLOW_TIMEOUT_SECOND.
+  uint32_t nat_ports_free; ///< The free NAT ports of all the SNAT addresses in the slice of the worker.
+  uint32_t nat6_ports_free; ///< The free NAT ports of SRC_IP6 in the slice of the worker.
+};
+
+/**
+ * Get the statistics of a packet worker.
+ *
+ * @param smto_cb The main control block of SmartOffload.
+ * @param lcore_id The lcore which runs the packet worker.
+ * @param stats The statistics to fill.
+ *
+ * @return 0 on success, or a negative value if no packet worker runs on the lcore.
+ */
+int get_worker_stats(struct smto *smto_cb, unsigned lcore_id, struct smto_worker_stats *stats);
+
+/// The statistics of the offload threshold controller.
+struct smto_offload_stats {
+  uint32_t offload_threshold; ///< The current amount of packets to create a flow rule.
+  uint32_t installed_rules; ///< The offload rules in the NIC.
+  uint32_t rule_capacity; ///< The rules the NIC can hold, NIC_RULE_CAPACITY.
+  unsigned int backlog; ///< The flows waiting in all the flow rules rings.
+  double insert_latency_us; ///< The moving average of microseconds to create a rule.
+};
+
+/**
+ * Get the statistics of the offload threshold controller.
+ *
+ * @param smto_cb The main control block of SmartOffload.
+ * @param stats The statistics to fill.
+ */
+void get_offload_stats(struct smto *smto_cb, struct smto_offload_stats *stats);
+
+/**
+ * Get the share of time a packet worker spends on processing packets, rather than polling empty queues or waiting.
+ *
+ * @param smto_cb The main control block of SmartOffload.
+ * @param lcore_id The lcore which runs the packet worker.
+ *
+ * @return The busy ratio between 0 and 1, or a negative value if no packet worker runs on the lcore.
+ */
+double get_worker_busy_ratio(struct smto *smto_cb, unsigned lcore_id);
+
 /**
  * Destroy SmartOffload.
  * @param smto_cb The main control block of SmartOffload.
@@ -48,6 +48,8 @@ enum smto_error_code {
   SMTO_ERROR_RING_CREATION,
   SMTO_ERROR_RING_OPERATION,
   SMTO_ERROR_UNSUPPORTED_PACKET_TYPE,
+  SMTO_ERROR_FLOW_DESTROY,
+  SMTO_ERROR_INVALID_SNAT_POOL,
   SMTO_ERROR_UNKNOWN = -100,
 };
 
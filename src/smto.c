@@ -28,8 +28,11 @@
 #include "internal/smto_flow_engine.h"
 #include "internal/smto_event.h"
 #include "internal/smto_flow_key.h"
+#include "internal/smto_parser.h"
 
-const uint32_t SRC_IP = RTE_IPV4(5, 1, 1, 1);
+
+/// fd00::5:1:1:1
+const uint8_t SRC_IP6[16] = {0xfd, 0x00, 0, 0, 0, 0, 0, 0, 0, 0x05, 0, 0x01, 0, 0x01, 0, 0x01};
 
 /// The global control block of SmartOffload.
 struct smto *smto_cb = 0;
@@ -37,6 +40,22 @@ struct smto *smto_cb = 0;
 /// The parameters for each worker threads.
 struct worker_parameter *worker_params;
 
+/**
+ * Free the parameters of the packet workers with their NAT port allocators.
+ *
+ * @param packet_worker_quantity The quantity of packet workers.
+ */
+static void free_worker_params(uint16_t packet_worker_quantity) {
+  if (worker_params == NULL) {
+    return;
+  }
+  for (uint16_t i = 0; i < packet_worker_quantity; i++) {
+    rte_free(worker_params[i].port_allocators);
+  }
+  rte_free(worker_params);
+  worker_params = NULL;
+}
+
 int init_smto(struct smto **smto) {
   int ret = 0;
   *smto = calloc(sizeof(struct smto), 1);
@@ -47,19 +66,12 @@ int init_smto(struct smto **smto) {
 
   smto_cb->logger = zlog_get_category("smto");
 
-  /// Check the quantity of workers
-  uint32_t worker_quantity = rte_lcore_count();
-  if (worker_quantity > GENERAL_QUEUES_QUANTITY + 2) {
-    zlog_warn(smto_cb->logger,
-              "worker quantity(%u) greater than required(queue quantity(%u) + flow_engine(1) + main(1)), the remaining worker will remain idle",
-              worker_quantity,
-              GENERAL_QUEUES_QUANTITY);
-  } else if (worker_quantity < GENERAL_QUEUES_QUANTITY + 2) {
-    zlog_error(smto_cb->logger,
-               "worker quantity(%u) should be greater than or equal to required(queue quantity(%u) + flow_engine(1) + main(1))",
-               worker_quantity,
-               GENERAL_QUEUES_QUANTITY);
-    ret = SMTO_ERROR_NO_ENOUGH_WORKER;
+  /// Select the packet parsing kernel by the running cpu
+  init_parser(smto_cb->logger);
+
+  /// Parse the addresses to translate the ipv4 flows to
+  ret = init_snat_pool(SNAT_POOL);
+  if (ret != SMTO_SUCCESS) {
     goto err;
   }
 
@@ -71,6 +83,50 @@ int init_smto(struct smto **smto) {
   } else if (port_quantity > 2) {
     zlog_warn(smto_cb->logger, "%d ports detected, but only use first two", port_quantity);
   }
+  smto_cb->mode = port_quantity == 1 ? SINGLE_PORT_MODE : DOUBLE_PORT_MODE;
+  uint16_t used_port_quantity = smto_cb->mode == SINGLE_PORT_MODE ? 1 : 2;
+  smto_cb->ports[0] = rte_eth_find_next_owned_by(0, RTE_ETH_DEV_NO_OWNER);
+  if (smto_cb->mode == DOUBLE_PORT_MODE) {
+    smto_cb->ports[1] = rte_eth_find_next_owned_by(smto_cb->ports[0] + 1, RTE_ETH_DEV_NO_OWNER);
+  }
+
+  /// Check the quantity of workers, each rx queue of each port is handled by one worker
+  uint32_t worker_quantity = rte_lcore_count();
+  if (worker_quantity < used_port_quantity + 2) {
+    zlog_error(smto_cb->logger,
+               "worker quantity(%u) should be greater than or equal to required(port quantity(%u) + flow_engine(1) + main(1))",
+               worker_quantity,
+               used_port_quantity);
+    ret = SMTO_ERROR_NO_ENOUGH_WORKER;
+    goto err;
+  }
+  smto_cb->queue_quantity = RTE_MIN((worker_quantity - 2) / used_port_quantity, MAX_QUEUES_QUANTITY);
+  for (uint16_t i = 0; i < used_port_quantity; i++) {
+    smto_cb->queue_quantity = RTE_MIN(smto_cb->queue_quantity, get_max_queue_quantity(smto_cb->ports[i]));
+  }
+  if (smto_cb->queue_quantity == 0) {
+    zlog_error(smto_cb->logger, "the ports do not have enough queues for the workers and hairpin");
+    ret = SMTO_ERROR_DEVICE_CONFIGURE;
+    goto err;
+  }
+  if (worker_quantity > smto_cb->queue_quantity * used_port_quantity + 2) {
+    zlog_warn(smto_cb->logger,
+              "worker quantity(%u) greater than required(queue quantity(%u) * port quantity(%u) + flow_engine(1) + main(1)), the remaining worker will remain idle",
+              worker_quantity,
+              smto_cb->queue_quantity,
+              used_port_quantity);
+  }
+  zlog_info(smto_cb->logger, "use %u rx/tx queues on each port", smto_cb->queue_quantity);
+
+#ifdef SHARDED_FLOW_TABLE
+  /// The in-direction packets arrive at the other port in dual port mode, so only shard in single port mode
+  if (smto_cb->mode == SINGLE_PORT_MODE) {
+    smto_cb->flow_table_sharded = true;
+    zlog_info(smto_cb->logger, "each packet worker owns a shard of the flow table");
+  } else {
+    zlog_warn(smto_cb->logger, "sharded flow table is only supported in single port mode, use a shared one");
+  }
+#endif
 
   /// Initialize the memory pool
   smto_cb->pkt_mbuf_pool = rte_pktmbuf_pool_create("smto_pool", NUM_MBUFS, CACHE_SIZE, 0,
@@ -85,8 +141,6 @@ int init_smto(struct smto **smto) {
   /// Config port and setup hairpin mode
   if (port_quantity == 1) {
     zlog_info(smto_cb->logger, "single port mode");
-    smto_cb->mode = SINGLE_PORT_MODE;
-    smto_cb->ports[0] = rte_eth_find_next_owned_by(0, RTE_ETH_DEV_NO_OWNER);
     init_port(smto_cb->ports[0]);
     ret = setup_one_port_hairpin(smto_cb->ports[0]);
     if (ret != 0) {
@@ -109,9 +163,6 @@ int init_smto(struct smto **smto) {
     }
   } else {
     zlog_info(smto_cb->logger, "dual port mode");
-    smto_cb->mode = DOUBLE_PORT_MODE;
-    smto_cb->ports[0] = rte_eth_find_next_owned_by(0, RTE_ETH_DEV_NO_OWNER);
-    smto_cb->ports[1] = rte_eth_find_next_owned_by(smto_cb->ports[0] + 1, RTE_ETH_DEV_NO_OWNER);
     init_port(smto_cb->ports[0]);
     init_port(smto_cb->ports[1]);
     ret = setup_two_port_hairpin(smto_cb->ports[0], smto_cb->ports[1]);
@@ -174,94 +225,71 @@ int init_smto(struct smto **smto) {
     goto err1;
   }
 
-  /// Create flow hash map
-  struct rte_hash_parameters flow_hash_map_parameter = {
-      .name = "flow_hash_table",
-      .entries = MAX_HASH_ENTRIES,
-      .key_len = sizeof(struct rdarm_five_tuple),
-#ifdef EM_HASH_CRC
-      .hash_func = rte_hash_crc,
-#else
-      .hash_func = rte_jhash,
-#endif
-      .hash_func_init_val = 622,
-      .extra_flag = RTE_HASH_EXTRA_FLAGS_RW_CONCURRENCY_LF
-  };
-  smto_cb->flow_hash_map = rte_hash_create(&flow_hash_map_parameter);
-  if (smto_cb->flow_hash_map == NULL) {
-    ret = SMTO_ERROR_HASH_MAP_CREATION;
-    goto err1;
+  /// Create flow hash map, whose readers are the packet workers
+  uint16_t packet_worker_quantity = smto_cb->queue_quantity * used_port_quantity;
+  smto_cb->packet_worker_quantity = packet_worker_quantity;
+  ret = create_hash_map();
+  if (ret != SMTO_SUCCESS) {
+    goto err2;
   }
 
-  /// Create ring for flow rules from worker to flow engine
-  ssize_t ring_size = rte_ring_get_memsize(MAX_RING_ENTRIES);
-  smto_cb->flow_rules_ring = rte_calloc("flow_rule_ring", ring_size, 1, 0);
-  if (smto_cb->flow_rules_ring == NULL) {
-    zlog_error(smto_cb->logger, "failed to allocate memory for flow rule ring");
+  /// Create the pool of flow keys, both directions of a flow are allocated as one object
+  smto_cb->flow_key_pool = rte_mempool_create("flow_key_pool", FLOW_KEY_POOL_SIZE,
+                                              sizeof(struct smto_flow_key_pair), CACHE_SIZE, 0,
+                                              NULL, NULL, NULL, NULL,
+                                              rte_socket_id(), 0);
+  if (smto_cb->flow_key_pool == NULL) {
+    zlog_error(smto_cb->logger, "failed to create flow key pool: %s", rte_strerror(rte_errno));
     ret = SMTO_ERROR_HUGE_PAGE_MEMORY_ALLOCATION;
     goto err2;
   }
-  ret = rte_ring_init(smto_cb->flow_rules_ring, "flow_rule_ring", MAX_RING_ENTRIES, RING_F_MP_RTS_ENQ | RING_F_SC_DEQ);
-  if (ret != 0) {
-    zlog_error(smto_cb->logger, "failed to initialize flow rule ring: %s", rte_strerror(rte_errno));
-    ret = SMTO_ERROR_RING_CREATION;
-    rte_free(smto_cb->flow_rules_ring);
-    goto err2;
-  }
 
-  /// Create ring for port pool
-  ring_size = rte_ring_get_memsize(MAX_HASH_ENTRIES);
-  smto_cb->port_pool = rte_calloc("port_pool", ring_size, 1, 0);
-  if (smto_cb->port_pool == NULL) {
-    zlog_error(smto_cb->logger, "failed to allocate memory for port pool ring");
-    ret = SMTO_ERROR_HUGE_PAGE_MEMORY_ALLOCATION;
-    goto err3;
-  }
-  ret = rte_ring_init(smto_cb->port_pool, "port_pool", MAX_HASH_ENTRIES, RING_F_MP_RTS_ENQ | RING_F_SC_DEQ);
-  if (ret != 0) {
-    zlog_error(smto_cb->logger, "failed to initialize port pool ring: %s", rte_strerror(rte_errno));
-    ret = SMTO_ERROR_RING_CREATION;
-    rte_free(smto_cb->port_pool);
-    goto err3;
-  }
-  for (int i = 1; i < MAX_HASH_ENTRIES; ++i) {
-    ret = rte_ring_enqueue(smto_cb->port_pool, (void *) (uintptr_t) i);
-    if (ret != 0) {
-      zlog_error(smto_cb->logger, "failed to enqueue port pool ring: %s", rte_strerror(rte_errno));
-      ret = SMTO_ERROR_RING_CREATION;
-      goto err4;
-    }
+  /// Create the rings for flow rules from each worker to flow engine
+  smto_cb->offload_threshold = RTE_MAX(PKT_AMOUNT_TO_OFFLOAD, OFFLOAD_THRESHOLD_MIN);
+  ret = create_flow_rules_rings();
+  if (ret != SMTO_SUCCESS) {
+    goto err2;
   }
 
   /// Register age timeout event
   if (register_aged_event(smto_cb->ports[0]) != 0) {
     ret = SMTO_ERROR_EVENT_REGISTER;
-    goto err4;
+    goto err3;
   }
 
   smto_cb->is_running = true;
 
   uint16_t lcore_id, index = 0;
-  worker_params = calloc(sizeof(struct worker_parameter), GENERAL_QUEUES_QUANTITY);
+  worker_params = rte_zmalloc("worker_params", sizeof(struct worker_parameter) * packet_worker_quantity, 0);
+  if (worker_params == NULL) {
+    ret = SMTO_ERROR_MEMORY_ALLOCATION;
+    goto err5;
+  }
   RTE_LCORE_FOREACH_WORKER(lcore_id) {
-    if (index < GENERAL_QUEUES_QUANTITY) { // The worker to process packets
-      worker_params[index].port_id = smto_cb->ports[0];
-      worker_params[index].queue_id = index;
-
-      if (rte_eal_remote_launch(process_loop, &worker_params[index], lcore_id) != 0) {
-        ret = SMTO_ERROR_WORKER_LAUNCH;
+    if (index < packet_worker_quantity) { // The worker to process packets, one for each queue of each port
+      worker_params[index].worker_id = index;
+      worker_params[index].lcore_id = lcore_id;
+      worker_params[index].port_id = smto_cb->ports[index / smto_cb->queue_quantity];
+      worker_params[index].queue_id = index % smto_cb->queue_quantity;
+      worker_params[index].flow_hash_map = GET_FLOW_HASH_MAP(smto_cb, index);
+      worker_params[index].flow6_hash_map = GET_FLOW6_HASH_MAP(smto_cb, index);
+      worker_params[index].flow_rules_ring = smto_cb->flow_rules_rings[index];
+      worker_params[index].flow_teardown_ring = smto_cb->flow_teardown_rings[index];
+      ret = create_port_allocators(&worker_params[index], (int) rte_lcore_to_socket_id(lcore_id));
+      if (ret != SMTO_SUCCESS) {
         goto err5;
       }
-    } else if (smto_cb->mode == DOUBLE_PORT_MODE && index < 2 * GENERAL_QUEUES_QUANTITY) {
-      worker_params[index].port_id = smto_cb->ports[1];
-      worker_params[index].queue_id = index - GENERAL_QUEUES_QUANTITY;
+      worker_params[index].sw_cksum = !has_tx_cksum_offload(worker_params[index].port_id);
+      if (worker_params[index].sw_cksum && worker_params[index].queue_id == 0) {
+        zlog_warn(smto_cb->logger, "port%u cannot offload checksums, update them by software",
+                  worker_params[index].port_id);
+      }
 
       if (rte_eal_remote_launch(process_loop, &worker_params[index], lcore_id) != 0) {
         ret = SMTO_ERROR_WORKER_LAUNCH;
         goto err5;
       }
-    } else if ((smto_cb->mode == SINGLE_PORT_MODE && index == GENERAL_QUEUES_QUANTITY)
-        || (smto_cb->mode == DOUBLE_PORT_MODE && index == GENERAL_QUEUES_QUANTITY * 2)) { // The worker to create flow
+    } else if (index == packet_worker_quantity) { // The worker to create flow
       if (rte_eal_remote_launch(create_flow_loop, NULL, lcore_id) != 0) {
         ret = SMTO_ERROR_WORKER_LAUNCH;
         goto err5;
@@ -274,14 +302,12 @@ int init_smto(struct smto **smto) {
   return SMTO_SUCCESS;
 
   err5:
-  free(worker_params);
   smto_cb->is_running = false;
   unregister_aged_event(smto_cb->ports[0]);
   rte_eal_mp_wait_lcore();
-  err4:
-  rte_free(smto_cb->port_pool);
+  free_worker_params(packet_worker_quantity);
   err3:
-  rte_free(smto_cb->flow_rules_ring);
+  destroy_flow_rules_rings();
   err2:
   destroy_hash_map();
   err1:
@@ -294,6 +320,58 @@ int init_smto(struct smto **smto) {
   return ret;
 }
 
+/**
+ * Find the packet worker running on a lcore.
+ *
+ * @return The parameter of the packet worker, or NULL if not found.
+ */
+static struct worker_parameter *find_packet_worker(struct smto *smto, unsigned lcore_id) {
+  for (uint16_t i = 0; i < smto->packet_worker_quantity; i++) {
+    if (worker_params[i].lcore_id == lcore_id) {
+      return &worker_params[i];
+    }
+  }
+  return NULL;
+}
+
+int get_worker_stats(struct smto *smto, unsigned lcore_id, struct smto_worker_stats *stats) {
+  struct worker_parameter *worker = find_packet_worker(smto, lcore_id);
+  if (worker == NULL) {
+    return -1;
+  }
+  stats->busy_ratio = get_busy_ratio(worker);
+  stats->idle_waits = worker->idle_waits;
+  stats->tx_retries = worker->tx_retries;
+  stats->tx_dropped = worker->tx_dropped;
+  stats->offload_enqueued = worker->offload_enqueued;
+  stats->offload_deferred = worker->offload_deferred;
+  stats->offload_ring_count = rte_ring_count(worker->flow_rules_ring);
+  stats->flows_closed = worker->flows_closed;
+  stats->flows_aged = worker->flows_aged;
+  stats->nat_ports_free = 0;
+  for (uint16_t i = 0; i < smto_cb->snat_ip_quantity; i++) {
+    stats->nat_ports_free += worker->port_allocators[i].free_ports;
+  }
+  stats->nat6_ports_free = worker->port_allocators[smto_cb->snat_ip_quantity].free_ports;
+  return 0;
+}
+
+void get_offload_stats(struct smto *smto, struct smto_offload_stats *stats) {
+  stats->offload_threshold = smto->offload_threshold;
+  stats->installed_rules = __atomic_load_n(&smto->installed_rules, __ATOMIC_RELAXED);
+  stats->rule_capacity = NIC_RULE_CAPACITY;
+  stats->backlog = 0;
+  for (uint16_t i = 0; i < smto->packet_worker_quantity; i++) {
+    stats->backlog += rte_ring_count(smto->flow_rules_rings[i]);
+  }
+  stats->insert_latency_us = (double) smto->insert_cycles * US_PER_S / (double) rte_get_tsc_hz();
+}
+
+double get_worker_busy_ratio(struct smto *smto, unsigned lcore_id) {
+  struct worker_parameter *worker = find_packet_worker(smto, lcore_id);
+  return worker == NULL ? -1 : get_busy_ratio(worker);
+}
+
 void destroy_smto(struct smto *smto) {
   smto->is_running = false;
   /// Wait for all the workers to exit
@@ -302,6 +380,7 @@ void destroy_smto(struct smto *smto) {
 
   /// Destroy flow hash map
   destroy_hash_map();
+  destroy_flow_rules_rings();
 
   /// Stop the port
   uint16_t port_id;
@@ -315,7 +394,7 @@ void destroy_smto(struct smto *smto) {
     rte_eth_dev_close(port_id);
   }
 
-  free(worker_params);
+  free_worker_params(smto->packet_worker_quantity);
   rte_eal_cleanup();
   zlog_fini();
   free(smto);
@@ -45,6 +45,8 @@ const char *smto_error_string(enum smto_error_code err_code) {
     case SMTO_ERROR_RING_CREATION: return "failed to create ring";
     case SMTO_ERROR_RING_OPERATION: return "failed to operate ring";
     case SMTO_ERROR_UNSUPPORTED_PACKET_TYPE: return "unsupported packet type";
+    case SMTO_ERROR_FLOW_DESTROY: return "failed to destroy flow";
+    case SMTO_ERROR_INVALID_SNAT_POOL: return "invalid snat address pool";
     case SMTO_ERROR_UNKNOWN: return "unknown error";
     default: return "unsupported error code";
   }
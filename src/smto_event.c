@@ -48,6 +48,25 @@ int query_counter(uint16_t port_id, struct rte_flow *flow, struct rte_flow_query
   return 0;
 }
 
+int get_flow_stats(uint16_t port_id, struct smto_flow_key *flow_key, struct smto_flow_stats *stats,
+                   struct rte_flow_error *error) {
+  int ret = 0;
+  read_flow_counter(&flow_key->sw_counter, &stats->sw_packets, &stats->sw_bytes);
+  stats->hw_packets = flow_key->hw_packets;
+  stats->hw_bytes = flow_key->hw_bytes;
+  if (flow_key->flow != NULL) {
+    struct rte_flow_query_count counter = {0};
+    ret = query_counter(port_id, flow_key->flow, &counter, error);
+    if (ret == 0) {
+      stats->hw_packets += counter.hits;
+      stats->hw_bytes += counter.bytes;
+    }
+  }
+  stats->packets = stats->sw_packets + stats->hw_packets;
+  stats->bytes = stats->sw_bytes + stats->hw_bytes;
+  return ret;
+}
+
 /**
  * Delete the timeout flows which are aged.
  *
@@ -61,14 +80,14 @@ void delete_timeout_flows(void *params) {
   int timeout_quantity = 0; ///< Quantity of timeout flows.
   struct rte_flow_error flow_error = {0};
 
+  /// The flow keys from the age contexts are held until the end, so they are not reclaimed meanwhile
+  rte_rcu_qsbr_thread_online(smto_cb->flow_table_rcu, AGED_EVENT_RCU_ID(smto_cb));
+
   /// Get the timeout flows
   timeout_quantity = rte_flow_get_aged_flows(port_id, flow_keys, TIMEOUT_FLOW_BATCH_SIZE, &flow_error);
   if (flow_error.type != RTE_FLOW_ERROR_TYPE_NONE) {
     zlog_error(smto_cb->logger, "failed to get timeout flows: %s", flow_error.message);
-    return;
-  }
-  if (timeout_quantity == 0) {
-    return;
+    timeout_quantity = 0;
   }
 
   struct smto_flow_key *flow_key = 0; ///< Used to iterate the timeout flows.
@@ -80,35 +99,52 @@ void delete_timeout_flows(void *params) {
     }
     flow_key = (struct smto_flow_key *) flow_keys[i];
     int queue_index = -1;
-    dump_pkt_info(&flow_key->tuple, port_id, queue_index, flow_key_str, MAX_PKT_INFO_LENGTH);
-    if (flow_key->flow == NULL) {
+    dump_flow_key_info(flow_key, port_id, queue_index, flow_key_str, MAX_PKT_INFO_LENGTH);
+    /// Claim the rte_flow from the flow engine, which may destroy it at the same time for a closed TCP connection
+    enum offload_status status = OFFLOAD_SUCCESS;
+    if (!__atomic_compare_exchange_n(&flow_key->is_offload, &status, OFFLOADING, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      if (status == OFFLOADING || status == OFFLOAD_CLOSED) {
+        zlog_info(smto_cb->logger, "flow(%s) has been deleted as the connection is closed", flow_key_str);
+      } else {
+        zlog_error(smto_cb->logger, "cannot get the rte_flow of flow(%s)", flow_key_str);
+      }
+    } else if (flow_key->flow == NULL) {
       zlog_error(smto_cb->logger, "cannot get the rte_flow of flow(%s)", flow_key_str);
+      __atomic_store_n(&flow_key->is_offload, OFFLOAD_SUCCESS, __ATOMIC_RELEASE);
     } else {
 
-      /// Query the counter of the timeout flow
-      struct rte_flow_query_count counter = {0};
-      ret = query_counter(port_id, flow_key->flow, &counter, &flow_error);
-      if (ret != 0) {
+      /// Query the counter of the timeout flow, which can not be destroyed by the flow engine once claimed
+      struct smto_flow_stats stats = {0};
+      bool is_queried = get_flow_stats(port_id, flow_key, &stats, &flow_error) == 0;
+      if (!is_queried) {
         zlog_error(smto_cb->logger, "cannot query the counter of a timeout flow(%s): %s",flow_key_str, flow_error.message);
       } else {
         zlog_info(smto_cb->logger,
-                  "flow(%s) timeout, total has %lu packets, fast-path has %lu packets and slow-path has %u packets.",
+                  "flow(%s) timeout, total has %lu packets, fast-path has %lu packets and slow-path has %lu packets.",
                   flow_key_str,
-                  flow_key->packet_amount + counter.hits, counter.hits, flow_key->packet_amount);
-        flow_key->packet_amount += counter.hits;
-        flow_key->flow_size += counter.bytes;
+                  stats.packets, stats.hw_packets, stats.sw_packets);
       }
 
       /// Delete the flow from nic
       ret = rte_flow_destroy(port_id, flow_key->flow, &flow_error);
       if (ret) {
         zlog_error(smto_cb->logger, "flow(%s) cannot be delete from nic: %s", flow_key_str, flow_error.message);
+        __atomic_store_n(&flow_key->is_offload, OFFLOAD_SUCCESS, __ATOMIC_RELEASE);
       } else {
-        flow_key->is_offload = NOT_OFFLOAD;
+        /// Keep the counts of the destroyed rte_flow, the flow key may be offloaded again
+        if (is_queried) {
+          flow_key->hw_packets = stats.hw_packets;
+          flow_key->hw_bytes = stats.hw_bytes;
+        }
+        flow_key->flow = NULL;
+        __atomic_store_n(&flow_key->is_offload, NOT_OFFLOAD, __ATOMIC_RELEASE);
+        __atomic_fetch_sub(&smto_cb->installed_rules, 1, __ATOMIC_RELAXED);
         zlog_info(smto_cb->logger, "flow(%s) has been delete because timeout", flow_key_str);
       }
     }
   }
+  rte_rcu_qsbr_thread_offline(smto_cb->flow_table_rcu, AGED_EVENT_RCU_ID(smto_cb));
 }
 
 /**
@@ -135,12 +171,15 @@ static int aged_event_callback(uint16_t port_id, enum rte_eth_event_type type,
 }
 
 int register_aged_event(uint16_t port_id) {
+  /// Offline until the timeout flows are deleted, so the grace periods do not wait for it in between
+  rte_rcu_qsbr_thread_register(smto_cb->flow_table_rcu, AGED_EVENT_RCU_ID(smto_cb));
   return rte_eth_dev_callback_register(port_id, RTE_ETH_EVENT_FLOW_AGED,
                                        aged_event_callback, NULL);
 }
 
 int unregister_aged_event(uint16_t port_id) {
   rte_eal_alarm_cancel(delete_timeout_flows, (void *) (intptr_t) port_id);
+  rte_rcu_qsbr_thread_unregister(smto_cb->flow_table_rcu, AGED_EVENT_RCU_ID(smto_cb));
   return rte_eth_dev_callback_unregister(port_id, RTE_ETH_EVENT_FLOW_AGED,
                                          aged_event_callback, NULL);
 }
\ No newline at end of file
@@ -66,10 +66,15 @@ struct rte_flow *create_default_jump_flow(uint16_t port_id) {
           .conf = NULL}
   };
   struct rte_flow_error error = {0};
-  flow = rte_flow_create(port_id, &attr, pattern, actions, &error);
-  if (flow == NULL) {
-    zlog_error(smto_cb->logger, "failed to create a default jump flow: %s", error.message);
-    return NULL;
+  /// Jump both ipv4 and ipv6 packets to the main group
+  const enum rte_flow_item_type l3_types[] = {RTE_FLOW_ITEM_TYPE_IPV4, RTE_FLOW_ITEM_TYPE_IPV6};
+  for (size_t i = 0; i < RTE_DIM(l3_types); i++) {
+    pattern[L3].type = l3_types[i];
+    flow = rte_flow_create(port_id, &attr, pattern, actions, &error);
+    if (flow == NULL) {
+      zlog_error(smto_cb->logger, "failed to create a default jump flow: %s", error.message);
+      return NULL;
+    }
   }
   return flow;
 }
@@ -115,15 +120,16 @@ struct rte_flow *create_default_rss_flow(uint16_t port_id) {
       0x6D, 0x5A, 0x6D, 0x5A,
   };
 
-  uint16_t queue_schedule[GENERAL_QUEUES_QUANTITY];
-  for (uint16_t i = 0; i < GENERAL_QUEUES_QUANTITY; i++) {
+  /// Spread the packets over all the worker queues
+  uint16_t queue_schedule[MAX_QUEUES_QUANTITY];
+  for (uint16_t i = 0; i < smto_cb->queue_quantity; i++) {
     queue_schedule[i] = i;
   }
 
   struct rte_flow_action_rss rss = {
-      .level = 1, ///< RSS should be done on inner header
+      .level = 1, ///< RSS should be done on the outermost header
       .queue = queue_schedule, ///< Set the selected target queues
-      .queue_num = GENERAL_QUEUES_QUANTITY, ///< The number of queues
+      .queue_num = smto_cb->queue_quantity, ///< The number of queues
       .types =  ETH_RSS_IP,
       .key = symmetric_rss_key,
       .key_len = 40};
@@ -138,18 +144,248 @@ struct rte_flow *create_default_rss_flow(uint16_t port_id) {
   };
 
   struct rte_flow_error error;
-  flow = rte_flow_create(port_id, &attr, pattern, actions, &error);
-  if (flow == NULL) {
-    zlog_error(smto_cb->logger, "failed to create a default rss flow: %s", error.message);
-    return NULL;
+  /**
+   * The tunneled flows are forwarded without translation, so hash them on the inner header to keep both directions
+   * of an inner flow on the same queue. Otherwise all the GRE packets between two endpoints land on one queue.
+   */
+  struct rte_flow_item_udp vxlan_udp_spec = {.hdr = {.dst_port = RTE_BE16(RTE_VXLAN_DEFAULT_PORT)}};
+  struct rte_flow_item_udp geneve_udp_spec = {.hdr = {.dst_port = RTE_BE16(RTE_GENEVE_DEFAULT_PORT)}};
+  struct rte_flow_item_udp tunnel_udp_mask = {.hdr = {.dst_port = RTE_BE16(0xffff)}};
+  struct rte_flow_item tunnel_pattern[] = {
+      [L2] = {
+          .type = RTE_FLOW_ITEM_TYPE_ETH,
+      },
+      [L3] = {
+          .type = RTE_FLOW_ITEM_TYPE_IPV4,
+      },
+      [L4] = {
+          .type = RTE_FLOW_ITEM_TYPE_GRE,
+      },
+      [END] = {
+          .type = RTE_FLOW_ITEM_TYPE_END
+      }
+  };
+  const struct rte_flow_item_udp *tunnel_udp_specs[] = {&vxlan_udp_spec, &geneve_udp_spec, NULL};
+  rss.level = 2;
+  attr.priority = 1;
+  for (size_t i = 0; i < RTE_DIM(tunnel_udp_specs); i++) {
+    if (tunnel_udp_specs[i] != NULL) {
+      tunnel_pattern[L4] = (struct rte_flow_item) {
+          .type = RTE_FLOW_ITEM_TYPE_UDP, .spec = tunnel_udp_specs[i], .mask = &tunnel_udp_mask};
+    } else {
+      tunnel_pattern[L4] = (struct rte_flow_item) {.type = RTE_FLOW_ITEM_TYPE_GRE};
+    }
+    flow = rte_flow_create(port_id, &attr, tunnel_pattern, actions, &error);
+    if (flow == NULL) {
+      zlog_error(smto_cb->logger, "failed to create a tunnel rss flow: %s", error.message);
+      return NULL;
+    }
+  }
+  rss.level = 1;
+
+  /**
+   * The reply of a translated flow is addressed to the SNAT pool, so the symmetric hash no longer brings it back to
+   * the queue of the original direction. In sharded mode, hash both directions on the address of the remote peer
+   * instead: the source address of the packets sent to the SNAT pool, and the destination address of the others.
+   * Flows towards the same peer will land on the same queue. The ipv4 replies take one rule for each prefix of the pool.
+   */
+  struct rte_flow_item_ipv4 reply_ipv4_spec = {0};
+  struct rte_flow_item_ipv4 reply_ipv4_mask = {0};
+  struct rte_flow_item_ipv6 reply_ipv6_spec = {0};
+  struct rte_flow_item_ipv6 reply_ipv6_mask = {0};
+  rte_memcpy(reply_ipv6_spec.hdr.dst_addr, SRC_IP6, sizeof(SRC_IP6));
+  memset(reply_ipv6_mask.hdr.dst_addr, 0xff, sizeof(reply_ipv6_mask.hdr.dst_addr));
+
+  const enum rte_flow_item_type l3_types[] = {RTE_FLOW_ITEM_TYPE_IPV4, RTE_FLOW_ITEM_TYPE_IPV6};
+  const void *reply_specs[] = {&reply_ipv4_spec, &reply_ipv6_spec};
+  const void *reply_masks[] = {&reply_ipv4_mask, &reply_ipv6_mask};
+  for (size_t i = 0; i < RTE_DIM(l3_types); i++) {
+    pattern[L3].type = l3_types[i];
+    if (smto_cb->flow_table_sharded) {
+      pattern[L3].spec = reply_specs[i];
+      pattern[L3].mask = reply_masks[i];
+      rss.types = ETH_RSS_IP | ETH_RSS_L3_SRC_ONLY;
+      attr.priority = 2;
+      uint16_t reply_quantity = l3_types[i] == RTE_FLOW_ITEM_TYPE_IPV4 ? smto_cb->snat_prefix_quantity : 1;
+      for (uint16_t j = 0; j < reply_quantity; j++) {
+        if (l3_types[i] == RTE_FLOW_ITEM_TYPE_IPV4) {
+          const struct smto_snat_prefix *prefix = &smto_cb->snat_prefixes[j];
+          uint32_t mask = prefix->depth == 0 ? 0 : UINT32_MAX << (32 - prefix->depth);
+          reply_ipv4_spec.hdr.dst_addr = rte_cpu_to_be_32(prefix->ip);
+          reply_ipv4_mask.hdr.dst_addr = rte_cpu_to_be_32(mask);
+        }
+        flow = rte_flow_create(port_id, &attr, pattern, actions, &error);
+        if (flow == NULL) {
+          zlog_error(smto_cb->logger, "failed to create a reply rss flow: %s", error.message);
+          return NULL;
+        }
+      }
+
+      pattern[L3].spec = NULL;
+      pattern[L3].mask = NULL;
+      rss.types = ETH_RSS_IP | ETH_RSS_L3_DST_ONLY;
+      attr.priority = 3;
+    } else {
+      attr.priority = 2;
+    }
+    flow = rte_flow_create(port_id, &attr, pattern, actions, &error);
+    if (flow == NULL) {
+      zlog_error(smto_cb->logger, "failed to create a default rss flow: %s", error.message);
+      return NULL;
+    }
   }
 
   return flow;
 }
 
+/**
+ * Create an offload flow which match the inner 5-tuple and the VNI of a tunneled flow, the packets are forwarded to
+ * the hairpin queue without translation.
+ *
+ * @param port_id The port which the flow will be affect.
+ * @param flow_key The flow key of a tunneled flow.
+ * @param error The error return by creating rte_flow.
+ * @return
+*      - not NULL: Create success.
+*      - NULL: Some error occur when create a rte_flow.
+ */
+static struct rte_flow *create_tunnel_offload_flow(uint16_t port_id,
+                                                   struct smto_flow_key *flow_key,
+                                                   struct rte_flow_error *error) {
+  struct rte_flow_attr attr = {
+      .group = 1,
+      .ingress = 1,
+      .priority = 0,
+  };
+  /// The outer udp header of VXLAN and GENEVE
+  struct rte_flow_item_udp outer_udp_spec = {
+      .hdr = {
+          .dst_port = flow_key->tunnel_type == SMTO_TUNNEL_VXLAN ? RTE_BE16(RTE_VXLAN_DEFAULT_PORT)
+                                                                 : RTE_BE16(RTE_GENEVE_DEFAULT_PORT),
+      }
+  };
+  struct rte_flow_item_udp outer_udp_mask = {.hdr = {.dst_port = RTE_BE16(0xffff)}};
+  struct rte_flow_item_vxlan vxlan_spec = {0};
+  struct rte_flow_item_vxlan vxlan_mask = {.vni = {0xff, 0xff, 0xff}};
+  struct rte_flow_item_geneve geneve_spec = {0};
+  struct rte_flow_item_geneve geneve_mask = {.vni = {0xff, 0xff, 0xff}};
+  rte_memcpy(vxlan_spec.vni, flow_key->tuple.prefix, sizeof(vxlan_spec.vni));
+  rte_memcpy(geneve_spec.vni, flow_key->tuple.prefix, sizeof(geneve_spec.vni));
+  /// Only the key present bit of GRE is matched, the VNI is in the high 24 bits of the key if it is present
+  struct rte_flow_item_gre gre_spec = {
+      .c_rsvd0_ver = flow_key->tunnel_type == SMTO_TUNNEL_GRE_NO_KEY ? 0 : RTE_BE16(0x2000)
+  };
+  struct rte_flow_item_gre gre_mask = {.c_rsvd0_ver = RTE_BE16(0x2000)};
+  uint8_t gre_key_bytes[sizeof(rte_be32_t)] = {0};
+  rte_memcpy(gre_key_bytes, flow_key->tuple.prefix, sizeof(flow_key->tuple.prefix));
+  rte_be32_t gre_key_spec;
+  rte_memcpy(&gre_key_spec, gre_key_bytes, sizeof(gre_key_spec));
+  rte_be32_t gre_key_mask = RTE_BE32(0xffffff00);
+  /// The inner ipv4 and l4 headers
+  struct rte_flow_item_ipv4 inner_ipv4_spec = {
+      .hdr = {
+          .src_addr = flow_key->tuple.ip1,
+          .dst_addr = flow_key->tuple.ip2,
+          .next_proto_id = flow_key->tuple.proto
+      }
+  };
+  struct rte_flow_item_ipv4 inner_ipv4_mask = {
+      .hdr = {
+          .src_addr = RTE_BE32(0xffffffff),
+          .dst_addr = RTE_BE32(0xffffffff),
+          .next_proto_id = 0xff
+      }
+  };
+  struct rte_flow_item_tcp inner_tcp_spec = {
+      .hdr = {
+          .src_port = flow_key->tuple.port1,
+          .dst_port = flow_key->tuple.port2,
+      }
+  };
+  struct rte_flow_item_udp inner_udp_spec = {
+      .hdr = {
+          .src_port = flow_key->tuple.port1,
+          .dst_port = flow_key->tuple.port2,
+      }
+  };
+
+  struct rte_flow_item pattern[8] = {{.type = RTE_FLOW_ITEM_TYPE_ETH}, {.type = RTE_FLOW_ITEM_TYPE_IPV4}};
+  uint8_t nb_items = 2;
+  switch (flow_key->tunnel_type) {
+    case SMTO_TUNNEL_VXLAN:
+      pattern[nb_items++] = (struct rte_flow_item) {
+          .type = RTE_FLOW_ITEM_TYPE_UDP, .spec = &outer_udp_spec, .mask = &outer_udp_mask};
+      pattern[nb_items++] = (struct rte_flow_item) {
+          .type = RTE_FLOW_ITEM_TYPE_VXLAN, .spec = &vxlan_spec, .mask = &vxlan_mask};
+      break;
+    case SMTO_TUNNEL_GENEVE:
+      pattern[nb_items++] = (struct rte_flow_item) {
+          .type = RTE_FLOW_ITEM_TYPE_UDP, .spec = &outer_udp_spec, .mask = &outer_udp_mask};
+      pattern[nb_items++] = (struct rte_flow_item) {
+          .type = RTE_FLOW_ITEM_TYPE_GENEVE, .spec = &geneve_spec, .mask = &geneve_mask};
+      break;
+    case SMTO_TUNNEL_GRE:
+    case SMTO_TUNNEL_NVGRE:
+      pattern[nb_items++] = (struct rte_flow_item) {
+          .type = RTE_FLOW_ITEM_TYPE_GRE, .spec = &gre_spec, .mask = &gre_mask};
+      pattern[nb_items++] = (struct rte_flow_item) {
+          .type = RTE_FLOW_ITEM_TYPE_GRE_KEY, .spec = &gre_key_spec, .mask = &gre_key_mask};
+      break;
+    case SMTO_TUNNEL_GRE_NO_KEY:
+      pattern[nb_items++] = (struct rte_flow_item) {
+          .type = RTE_FLOW_ITEM_TYPE_GRE, .spec = &gre_spec, .mask = &gre_mask};
+      break;
+    default:
+      zlog_error(smto_cb->logger, "unsupported tunnel type %u", flow_key->tunnel_type);
+      return NULL;
+  }
+  if (flow_key->tunnel_type != SMTO_TUNNEL_GRE && flow_key->tunnel_type != SMTO_TUNNEL_GRE_NO_KEY) {
+    pattern[nb_items++] = (struct rte_flow_item) {.type = RTE_FLOW_ITEM_TYPE_ETH};
+  }
+  pattern[nb_items++] = (struct rte_flow_item) {
+      .type = RTE_FLOW_ITEM_TYPE_IPV4, .spec = &inner_ipv4_spec, .mask = &inner_ipv4_mask};
+  if (flow_key->tuple.proto == IPPROTO_TCP) {
+    pattern[nb_items++] = (struct rte_flow_item) {.type = RTE_FLOW_ITEM_TYPE_TCP, .spec = &inner_tcp_spec};
+  } else {
+    pattern[nb_items++] = (struct rte_flow_item) {.type = RTE_FLOW_ITEM_TYPE_UDP, .spec = &inner_udp_spec};
+  }
+  pattern[nb_items] = (struct rte_flow_item) {.type = RTE_FLOW_ITEM_TYPE_END};
+
+  struct rte_flow_action_queue hairpin_queue = {
+      .index = smto_cb->queue_quantity,
+  };
+  struct rte_flow_action_count dedicated_counter = {
+  };
+  struct rte_flow_action_age age_action = {
+      .context = flow_key,
+      .timeout = FLOW_TIMEOUT_SECOND
+  };
+  struct rte_flow_action actions[] = {
+      {
+          .type = RTE_FLOW_ACTION_TYPE_COUNT,
+          .conf = &dedicated_counter,
+      },
+      {
+          .type = RTE_FLOW_ACTION_TYPE_AGE,
+          .conf = &age_action
+      },
+      {
+          .type = RTE_FLOW_ACTION_TYPE_QUEUE,
+          .conf = &hairpin_queue
+      },
+      {
+          .type = RTE_FLOW_ACTION_TYPE_END,
+      }
+  };
+  return rte_flow_create(port_id, &attr, pattern, actions, error);
+}
+
 struct rte_flow *create_general_offload_flow(uint16_t port_id,
                                              struct smto_flow_key *flow_key,
                                              struct rte_flow_error *error) {
+  if (flow_key->tunnel_type != SMTO_TUNNEL_NONE) {
+    return create_tunnel_offload_flow(port_id, flow_key, error);
+  }
   /// The rte flow will be created
   struct rte_flow *flow = 0;
   /// The basic attribute of rte flow
@@ -174,7 +410,10 @@ struct rte_flow *create_general_offload_flow(uint16_t port_id,
           .next_proto_id = 0xff
       }
   };
-  /// Define the pattern to match the packet
+  /// The specific pattern and mask of ipv6 header
+  struct rte_flow_item_ipv6 ipv6_pattern_spec = {0};
+  struct rte_flow_item_ipv6 ipv6_pattern_mask = {0};
+  /// Define the pattern to match the packet, the VLAN tags are inserted after the ethernet header later
   struct rte_flow_item pattern[] = {
       [L2] = {
           .type = RTE_FLOW_ITEM_TYPE_ETH,
@@ -192,36 +431,110 @@ struct rte_flow *create_general_offload_flow(uint16_t port_id,
       }
 
   };
-  if (flow_key->tuple.proto == IPPROTO_TCP) {
+  uint8_t proto = flow_key->tuple.proto;
+  uint16_t src_port = flow_key->tuple.port1;
+  uint16_t dst_port = flow_key->tuple.port2;
+  if (flow_key->is_ipv6) {
+    rte_memcpy(ipv6_pattern_spec.hdr.src_addr, flow_key->tuple6.ip1, sizeof(flow_key->tuple6.ip1));
+    rte_memcpy(ipv6_pattern_spec.hdr.dst_addr, flow_key->tuple6.ip2, sizeof(flow_key->tuple6.ip2));
+    ipv6_pattern_spec.hdr.proto = flow_key->tuple6.proto;
+    memset(ipv6_pattern_mask.hdr.src_addr, 0xff, sizeof(ipv6_pattern_mask.hdr.src_addr));
+    memset(ipv6_pattern_mask.hdr.dst_addr, 0xff, sizeof(ipv6_pattern_mask.hdr.dst_addr));
+    ipv6_pattern_mask.hdr.proto = 0xff;
+    pattern[L3].type = RTE_FLOW_ITEM_TYPE_IPV6;
+    pattern[L3].spec = &ipv6_pattern_spec;
+    pattern[L3].mask = &ipv6_pattern_mask;
+    proto = flow_key->tuple6.proto;
+    src_port = flow_key->tuple6.port1;
+    dst_port = flow_key->tuple6.port2;
+  }
+
+  struct rte_flow_item_tcp tcp_pattern = {
+      .hdr = {
+          .src_port = src_port,
+          .dst_port = dst_port,
+      }
+  };
+  /// The packets with SYN, FIN or RST miss the rule and go to the workers, which track the state of the connection
+  struct rte_flow_item_tcp tcp_mask = {
+      .hdr = {
+          .src_port = RTE_BE16(0xffff),
+          .dst_port = RTE_BE16(0xffff),
+          .tcp_flags = RTE_TCP_SYN_FLAG | RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG,
+      }
+  };
+  struct rte_flow_item_udp udp_pattern = {
+      .hdr = {
+          .src_port = src_port,
+          .dst_port = dst_port,
+      }
+  };
+  if (proto == IPPROTO_TCP) {
     pattern[L4].type = RTE_FLOW_ITEM_TYPE_TCP;
-    struct rte_flow_item_tcp tcp_pattern = {
-        .hdr = {
-            .src_port = flow_key->tuple.port1,
-            .dst_port = flow_key->tuple.port2,
-        }
-    };
     pattern[L4].spec = &tcp_pattern;
-  } else if (flow_key->tuple.proto == IPPROTO_UDP) {
+    pattern[L4].mask = &tcp_mask;
+  } else if (proto == IPPROTO_UDP) {
     pattern[L4].type = RTE_FLOW_ITEM_TYPE_UDP;
-    struct rte_flow_item_udp udp_pattern = {
-        .hdr = {
-            .src_port = flow_key->tuple.port1,
-            .dst_port = flow_key->tuple.port2,
-        }
-    };
     pattern[L4].spec = &udp_pattern;
   } else {
-    zlog_error(smto_cb->logger, "unsupported l4 proto type %u", flow_key->tuple.proto);
+    zlog_error(smto_cb->logger, "unsupported l4 proto type %u", proto);
     return flow;
   }
 
-  /// Define an action to change the dst of ipv4
+  /**
+   * The tenants trunked over the port are told apart by their VLAN IDs, so the untagged flows only match untagged
+   * packets, and a single tag does not match a QinQ packet.
+   */
+  uint32_t vlan_scope = get_tuple_scope(flow_key->is_ipv6 ? (const void *) flow_key->tuple6.prefix
+                                                          : (const void *) flow_key->tuple.prefix);
+  struct rte_flow_item_eth eth_pattern_spec = {.has_vlan = flow_key->vlan_depth != 0};
+  struct rte_flow_item_eth eth_pattern_mask = {.has_vlan = 1};
+  struct rte_flow_item_vlan vlan_pattern_specs[2] = {
+      {
+          .tci = rte_cpu_to_be_16(flow_key->vlan_depth == 2 ? vlan_scope >> VLAN_ID_BITS : vlan_scope),
+          .has_more_vlan = flow_key->vlan_depth == 2,
+      },
+      {
+          .tci = rte_cpu_to_be_16(vlan_scope & RTE_LEN2MASK(VLAN_ID_BITS, uint32_t)),
+      }
+  };
+  struct rte_flow_item_vlan vlan_pattern_mask = {
+      .tci = RTE_BE16(RTE_LEN2MASK(VLAN_ID_BITS, uint16_t)),
+      .has_more_vlan = 1,
+  };
+  struct rte_flow_item vlan_pattern[RTE_DIM(pattern) + RTE_DIM(vlan_pattern_specs)];
+  uint8_t nb_items = 0;
+  pattern[L2].spec = &eth_pattern_spec;
+  pattern[L2].mask = &eth_pattern_mask;
+  vlan_pattern[nb_items++] = pattern[L2];
+  for (uint8_t i = 0; i < flow_key->vlan_depth; i++) {
+    vlan_pattern[nb_items++] = (struct rte_flow_item) {
+        .type = RTE_FLOW_ITEM_TYPE_VLAN, .spec = &vlan_pattern_specs[i], .mask = &vlan_pattern_mask};
+  }
+  for (uint8_t i = L3; i <= END; i++) {
+    vlan_pattern[nb_items++] = pattern[i];
+  }
+
+  /// Define the actions to translate the flow as the slow path does, by its rewrite template
+  struct rte_flow_action_set_ipv4 ipv4_new_src = {
+      .ipv4_addr = flow_key->modify_tuple.ip1
+  };
   struct rte_flow_action_set_ipv4 ipv4_new_dst = {
-      .ipv4_addr = RTE_IPV4(5, 5, 5, 5)
+      .ipv4_addr = flow_key->modify_tuple.ip2
+  };
+  struct rte_flow_action_set_ipv6 ipv6_new_src = {0};
+  struct rte_flow_action_set_ipv6 ipv6_new_dst = {0};
+  struct rte_flow_action_set_tp tp_new_src = {
+      .port = flow_key->is_ipv6 ? flow_key->modify_tuple6.port1 : flow_key->modify_tuple.port1
   };
+  struct rte_flow_action_set_tp tp_new_dst = {
+      .port = flow_key->is_ipv6 ? flow_key->modify_tuple6.port2 : flow_key->modify_tuple.port2
+  };
+  rte_memcpy(ipv6_new_src.ipv6_addr, flow_key->modify_tuple6.ip1, sizeof(ipv6_new_src.ipv6_addr));
+  rte_memcpy(ipv6_new_dst.ipv6_addr, flow_key->modify_tuple6.ip2, sizeof(ipv6_new_dst.ipv6_addr));
   /// Define an action to send packet to hairpin queue
   struct rte_flow_action_queue hairpin_queue = {
-      .index = HAIRPIN_QUEUE_INDEX,
+      .index = smto_cb->queue_quantity,
   };
   /// Define a counter to count the quantity of packet
   struct rte_flow_action_count dedicated_counter = {
@@ -235,10 +548,22 @@ struct rte_flow *create_general_offload_flow(uint16_t port_id,
 
   /// Define the action pipeline
   struct rte_flow_action actions[] = {
+      {
+          .type = RTE_FLOW_ACTION_TYPE_SET_IPV4_SRC,
+          .conf = &ipv4_new_src
+      },
       {
           .type = RTE_FLOW_ACTION_TYPE_SET_IPV4_DST,
           .conf = &ipv4_new_dst
       },
+      {
+          .type = RTE_FLOW_ACTION_TYPE_SET_TP_SRC,
+          .conf = &tp_new_src
+      },
+      {
+          .type = RTE_FLOW_ACTION_TYPE_SET_TP_DST,
+          .conf = &tp_new_dst
+      },
       {
           .type = RTE_FLOW_ACTION_TYPE_COUNT,
           .conf = &dedicated_counter,
@@ -255,54 +580,259 @@ struct rte_flow *create_general_offload_flow(uint16_t port_id,
           .type = RTE_FLOW_ACTION_TYPE_END,
       }
   };
+  if (flow_key->is_ipv6) {
+    actions[0] = (struct rte_flow_action) {.type = RTE_FLOW_ACTION_TYPE_SET_IPV6_SRC, .conf = &ipv6_new_src};
+    actions[1] = (struct rte_flow_action) {.type = RTE_FLOW_ACTION_TYPE_SET_IPV6_DST, .conf = &ipv6_new_dst};
+  }
 
-  flow = rte_flow_create(port_id, &attr, pattern, actions, error);
+  flow = rte_flow_create(port_id, &attr, vlan_pattern, actions, error);
   return flow;
 }
 
+/**
+ * Create the offload rule of a flow, and account its latency and the installed rules for the offload threshold.
+ *
+ * @param port_id The port to create the rule on.
+ * @param flow_key The flow to offload.
+ * @param error The error of creation.
+ *
+ * @return The rule, or NULL on error.
+ */
+static struct rte_flow *install_offload_flow(uint16_t port_id, struct smto_flow_key *flow_key,
+                                             struct rte_flow_error *error) {
+  uint64_t start_tsc = rte_rdtsc();
+  struct rte_flow *flow = create_general_offload_flow(port_id, flow_key, error);
+  uint64_t cycles = rte_rdtsc() - start_tsc;
+  /// Only the flow engine writes the average, by the weight of 1/8 for the new sample
+  smto_cb->insert_cycles = smto_cb->insert_cycles == 0 ? cycles : (smto_cb->insert_cycles * 7 + cycles) / 8;
+  if (flow != NULL) {
+    __atomic_fetch_add(&smto_cb->installed_rules, 1, __ATOMIC_RELAXED);
+  }
+  return flow;
+}
+
+/**
+ * Adjust the amount of packets to offload a flow by the load of the flow engine and the rule table of the NIC.
+ * The threshold is doubled when the flow rules rings take longer than OFFLOAD_BACKLOG_US to drain, any ring is half
+ * full, the rule table is 90% full or a rule fails to be created, so it backs off quickly before a ring overflows.
+ * It is lowered by a quarter when all of them have plenty of headroom, to offload as many flows as possible.
+ *
+ * @param failures The rules failed to be created since the last adjustment.
+ */
+static void adjust_offload_threshold(uint32_t failures) {
+  unsigned int backlog = 0, max_ring_count = 0;
+  for (uint16_t i = 0; i < smto_cb->packet_worker_quantity; i++) {
+    unsigned int count = rte_ring_count(smto_cb->flow_rules_rings[i]);
+    backlog += count;
+    max_ring_count = RTE_MAX(max_ring_count, count);
+  }
+  /// Each flow in the rings takes two rules
+  uint64_t drain_us = (uint64_t) backlog * 2 * smto_cb->insert_cycles * US_PER_S / rte_get_tsc_hz();
+  uint32_t installed_rules = __atomic_load_n(&smto_cb->installed_rules, __ATOMIC_RELAXED);
+  uint32_t threshold = smto_cb->offload_threshold;
+
+  if (failures > 0 || drain_us > OFFLOAD_BACKLOG_US || max_ring_count > MAX_RING_ENTRIES / 2
+      || installed_rules > NIC_RULE_CAPACITY / 10 * 9) {
+    threshold = RTE_MIN(threshold * 2, OFFLOAD_THRESHOLD_MAX);
+  } else if (drain_us < OFFLOAD_BACKLOG_US / 4 && max_ring_count < MAX_RING_ENTRIES / 8
+      && installed_rules < NIC_RULE_CAPACITY / 10 * 7) {
+    threshold = RTE_MAX(threshold - (threshold + 3) / 4, OFFLOAD_THRESHOLD_MIN);
+  }
+  if (threshold != smto_cb->offload_threshold) {
+    zlog_debug(smto_cb->logger,
+               "offload threshold %u -> %u: backlog %u flows (%lu us), %u rules installed, %u failures",
+               smto_cb->offload_threshold, threshold, backlog, drain_us, installed_rules, failures);
+    smto_cb->offload_threshold = threshold;
+  }
+}
+
+/**
+ * Destroy the rte_flow of one direction of a closing TCP connection, and mark it closed so it is never offloaded again.
+ *
+ * @param flow_key The flow key of the direction.
+ *
+ * @return SMTO_SUCCESS if it is closed, -EAGAIN if it is being offloaded or aged and should be retried, or
+ *         SMTO_ERROR_FLOW_DESTROY if the rte_flow cannot be destroyed, which is left to aging.
+ */
+static int close_offload_flow(struct smto_flow_key *flow_key) {
+  enum offload_status status = NOT_OFFLOAD;
+  if (__atomic_compare_exchange_n(&flow_key->is_offload, &status, OFFLOAD_CLOSED, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED) || status == OFFLOAD_CLOSED) {
+    return SMTO_SUCCESS;
+  }
+  /// Claim the rte_flow from the aged event thread, which may destroy it at the same time
+  if (status != OFFLOAD_SUCCESS || !__atomic_compare_exchange_n(&flow_key->is_offload, &status, OFFLOADING, false,
+                                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return -EAGAIN;
+  }
+  struct rte_flow_error error = {0};
+  if (rte_flow_destroy(smto_cb->ports[flow_key->rule_port_index], flow_key->flow, &error) != 0) {
+    zlog_error(smto_cb->logger, "cannot destroy the rte_flow of a closed connection: %s", error.message);
+    __atomic_store_n(&flow_key->is_offload, OFFLOAD_SUCCESS, __ATOMIC_RELEASE);
+    return SMTO_ERROR_FLOW_DESTROY;
+  }
+  __atomic_fetch_sub(&smto_cb->installed_rules, 1, __ATOMIC_RELAXED);
+  flow_key->flow = NULL;
+  __atomic_store_n(&flow_key->is_offload, OFFLOAD_CLOSED, __ATOMIC_RELEASE);
+  return SMTO_SUCCESS;
+}
+
+/**
+ * Withdraw a stage of closing a TCP connection which is given up, so it is requested again by a later packet or the
+ * aging of the flow, instead of being taken as in progress forever.
+ *
+ * @param flow_key The out-direction flow key of the connection.
+ * @param stage The enum smto_tcp_close stage.
+ */
+static inline void withdraw_tcp_close(struct smto_flow_key *flow_key, uint8_t stage) {
+  __atomic_fetch_and(&flow_key->tcp_close, (uint8_t) ~stage, __ATOMIC_RELAXED);
+}
+
+/**
+ * Execute a stage of closing a TCP connection requested by a worker. The rte_flows of both directions are destroyed
+ * for every stage, and the connection is handed back to the worker which creates it to remove the flow state for
+ * TCP_CLOSE_STATE. The flow state is never removed while a rte_flow, whose age context is the flow key, still exists.
+ *
+ * @param flow_key The out-direction flow key of the connection.
+ * @param stage The enum smto_tcp_close stage.
+ *
+ * @return SMTO_SUCCESS if the stage is finished or given up, or -EAGAIN if it should be retried.
+ */
+static int close_tcp_connection(struct smto_flow_key *flow_key, uint8_t stage) {
+  /// The rte_flows may still be destroyed by a TCP_CLOSE_RULES request in the ring of another worker
+  if (stage == TCP_CLOSE_STATE && (__atomic_load_n(&flow_key->tcp_close, __ATOMIC_RELAXED) & TCP_CLOSE_RULES)
+      && !(flow_key->tcp_close_done & TCP_CLOSE_RULES)) {
+    return -EAGAIN;
+  }
+  int ret = close_offload_flow(flow_key);
+  int symmetrical_ret = close_offload_flow(flow_key->symmetrical_flow_key);
+  if (ret == SMTO_SUCCESS || symmetrical_ret > 0) {
+    ret = symmetrical_ret;
+  }
+  if (ret == -EAGAIN) {
+    return ret;
+  }
+  if (stage == TCP_CLOSE_STATE) {
+    if (ret != SMTO_SUCCESS) {
+      /// The rte_flow is left to aging, after which the flow is requested to be removed again
+      withdraw_tcp_close(flow_key, stage);
+    } else if (rte_ring_enqueue(smto_cb->flow_teardown_rings[flow_key->worker_id], flow_key) != 0) {
+      return -EAGAIN;
+    }
+  }
+  flow_key->tcp_close_done |= stage;
+  return SMTO_SUCCESS;
+}
+
 int create_flow_loop(void *args) {
-  void *flow_rules[5];
+  void *flow_rules[FLOW_RULES_BURST_SIZE];
   uint32_t result = 0;
-  uint32_t remain = 0;
+  uint16_t ring_index = 0;
+  uint32_t failures = 0;
   struct smto_flow_key *flow_key = NULL;
   char pkt_info[MAX_PKT_INFO_LENGTH];
+  const uint64_t control_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * OFFLOAD_CONTROL_US;
+  uint64_t last_control_tsc = rte_rdtsc();
+  void *pending_closes[MAX_PENDING_CLOSES]; ///< The tagged TCP connections to close again.
+  uint32_t nb_pending_closes = 0;
 
   zlog_info(smto_cb->logger, "worker%d for flow engine start working!", rte_lcore_id());
+  rte_rcu_qsbr_thread_register(smto_cb->flow_table_rcu, FLOW_ENGINE_RCU_ID(smto_cb));
+  rte_rcu_qsbr_thread_online(smto_cb->flow_table_rcu, FLOW_ENGINE_RCU_ID(smto_cb));
   while (smto_cb->is_running) {
-    result = rte_ring_dequeue_burst(smto_cb->flow_rules_ring, flow_rules, 5, &remain);
+    /**
+     * No flow key of the last loop is held here, except the pending TCP connections, which are not handed back to be
+     * removed yet. A flow in the rings is OFFLOADING, so it is not closed until the flow engine has dequeued it.
+     */
+    rte_rcu_qsbr_quiescent(smto_cb->flow_table_rcu, FLOW_ENGINE_RCU_ID(smto_cb));
+    uint64_t current_tsc = rte_rdtsc();
+    if (unlikely(current_tsc - last_control_tsc > control_tsc)) {
+      adjust_offload_threshold(failures);
+      failures = 0;
+      last_control_tsc = current_tsc;
+    }
+    /// Retry the TCP connections which are waiting for their pending offload or aging
+    uint32_t nb_retries = nb_pending_closes;
+    nb_pending_closes = 0;
+    for (uint32_t i = 0; i < nb_retries; i++) {
+      uintptr_t tagged = (uintptr_t) pending_closes[i];
+      if (close_tcp_connection((struct smto_flow_key *) (tagged & ~FLOW_RULE_TAG_MASK),
+                               tagged & FLOW_RULE_TAG_MASK) == -EAGAIN) {
+        pending_closes[nb_pending_closes++] = pending_closes[i];
+      }
+    }
+    /// Drain the rings of the packet workers in round-robin, a burst from each one, so a busy worker can not starve
+    /// the others.
+    struct rte_ring *flow_rules_ring = smto_cb->flow_rules_rings[ring_index];
+    if (++ring_index == smto_cb->packet_worker_quantity) {
+      ring_index = 0;
+    }
+    result = rte_ring_dequeue_burst(flow_rules_ring, flow_rules, FLOW_RULES_BURST_SIZE, NULL);
     for (uint32_t i = 0; i < result; ++i) {
+      uintptr_t tag = (uintptr_t) flow_rules[i] & FLOW_RULE_TAG_MASK;
+      if (tag != 0) {
+        struct smto_flow_key *closing_flow_key =
+            (struct smto_flow_key *) ((uintptr_t) flow_rules[i] & ~FLOW_RULE_TAG_MASK);
+        if (close_tcp_connection(closing_flow_key, tag) == -EAGAIN) {
+          if (nb_pending_closes < MAX_PENDING_CLOSES) {
+            pending_closes[nb_pending_closes++] = flow_rules[i];
+          } else {
+            zlog_warn(smto_cb->logger, "too many pending TCP connections to close, leave one to aging");
+            withdraw_tcp_close(closing_flow_key, tag);
+          }
+        }
+        continue;
+      }
       flow_key = (struct smto_flow_key *) flow_rules[i];
+      if (__atomic_load_n(&flow_key->is_offload, __ATOMIC_RELAXED) == OFFLOAD_SUCCESS) {
+        /// Already installed as the reverse direction of its peer, another rule would leak the first one
+        continue;
+      }
+      if (__atomic_load_n(&get_flow_key_pair(flow_key)->out.tcp_close, __ATOMIC_RELAXED) != 0) {
+        /// The connection is closing, so its rte_flows would be destroyed right after creation
+        __atomic_store_n(&flow_key->is_offload, NOT_OFFLOAD, __ATOMIC_RELAXED);
+        continue;
+      }
       struct rte_flow_error error;
-      struct rte_flow *flow = create_general_offload_flow(smto_cb->ports[0], flow_key, &error);
+      struct rte_flow *flow = install_offload_flow(smto_cb->ports[0], flow_key, &error);
       if (flow == NULL) {
-        dump_pkt_info(&flow_key->tuple, smto_cb->ports[0], -1, pkt_info, MAX_PKT_INFO_LENGTH);
+        dump_flow_key_info(flow_key, smto_cb->ports[0], -1, pkt_info, MAX_PKT_INFO_LENGTH);
         zlog_error(smto_cb->logger, "failed to create a flow(%s): %s", pkt_info, error.message);
-        flow_key->is_offload = NOT_OFFLOAD;
+        __atomic_store_n(&flow_key->is_offload, NOT_OFFLOAD, __ATOMIC_RELAXED);
+        failures++;
         continue;
       }
+      /// Publish the rte_flow before the status, the aged event thread reads it after seeing OFFLOAD_SUCCESS
       flow_key->flow = flow;
-      flow_key->is_offload = OFFLOAD_SUCCESS;
+      flow_key->rule_port_index = 0;
+      __atomic_store_n(&flow_key->is_offload, OFFLOAD_SUCCESS, __ATOMIC_RELEASE);
 
-      if (smto_cb->mode == SINGLE_PORT_MODE) { /// Create a flow for symmetrical flow on the same port.
-        flow = create_general_offload_flow(smto_cb->ports[0], flow_key->symmetrical_flow_key, &error);
-        if (flow == NULL) {
-          dump_pkt_info(&flow_key->tuple, smto_cb->ports[0], -1, pkt_info, MAX_PKT_INFO_LENGTH);
-          zlog_error(smto_cb->logger, "failed to create a flow(%s): %s", pkt_info, error.message);
-          flow_key->symmetrical_flow_key->is_offload = NOT_OFFLOAD;
-          continue;
-        }
-      } else if (smto_cb->mode == DOUBLE_PORT_MODE) { /// Create a flow for symmetrical flow on the other port.
-        flow = create_general_offload_flow(smto_cb->ports[1], flow_key->symmetrical_flow_key, &error);
-        if (flow == NULL) {
-          dump_pkt_info(&flow_key->tuple, smto_cb->ports[1], -1, pkt_info, MAX_PKT_INFO_LENGTH);
-          zlog_error(smto_cb->logger, "failed to create a flow(%s): %s", pkt_info, error.message);
-          flow_key->symmetrical_flow_key->is_offload = NOT_OFFLOAD;
-          continue;
-        }
+      /**
+       * Claim the symmetrical flow before creating its rte_flow. It is skipped if it is already offloaded, or queued by
+       * a worker which has set it to OFFLOADING, so it gets its own rte_flow when it is dequeued.
+       */
+      struct smto_flow_key *symmetrical_flow_key = flow_key->symmetrical_flow_key;
+      enum offload_status not_offload = NOT_OFFLOAD;
+      if (!__atomic_compare_exchange_n(&symmetrical_flow_key->is_offload, &not_offload, OFFLOADING, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        continue;
       }
-      flow_key->symmetrical_flow_key->flow = flow;
-      flow_key->symmetrical_flow_key->is_offload = OFFLOAD_SUCCESS;
+      /// Create a flow for symmetrical flow on the same port in single port mode, or on the other port
+      uint8_t rule_port_index = smto_cb->mode == DOUBLE_PORT_MODE ? 1 : 0;
+      flow = install_offload_flow(smto_cb->ports[rule_port_index], symmetrical_flow_key, &error);
+      if (flow == NULL) {
+        dump_flow_key_info(flow_key, smto_cb->ports[rule_port_index], -1, pkt_info, MAX_PKT_INFO_LENGTH);
+        zlog_error(smto_cb->logger, "failed to create a flow(%s): %s", pkt_info, error.message);
+        __atomic_store_n(&symmetrical_flow_key->is_offload, NOT_OFFLOAD, __ATOMIC_RELAXED);
+        failures++;
+        continue;
+      }
+      symmetrical_flow_key->flow = flow;
+      symmetrical_flow_key->rule_port_index = rule_port_index;
+      __atomic_store_n(&symmetrical_flow_key->is_offload, OFFLOAD_SUCCESS, __ATOMIC_RELEASE);
     }
   }
+  rte_rcu_qsbr_thread_offline(smto_cb->flow_table_rcu, FLOW_ENGINE_RCU_ID(smto_cb));
+  rte_rcu_qsbr_thread_unregister(smto_cb->flow_table_rcu, FLOW_ENGINE_RCU_ID(smto_cb));
   return 0;
-}
\ No newline at end of file
+}
@@ -23,6 +23,7 @@
 */
 
 
+#include <arpa/inet.h>
 #include <rte_byteorder.h>
 #include "internal/smto_flow_key.h"
 
@@ -57,3 +58,20 @@ void dump_pkt_info(struct rdarm_five_tuple *key,uint16_t port_id, int qi, char *
              (dst_ip) & 0x000000ff, dst_port, port_id);
   }
 }
+
+void dump_ipv6_pkt_info(struct smto_ipv6_tuple *key, uint16_t port_id, int qi, char *result, int result_length) {
+  char src_ip[INET6_ADDRSTRLEN];
+  char dst_ip[INET6_ADDRSTRLEN];
+  inet_ntop(AF_INET6, key->ip1, src_ip, sizeof(src_ip));
+  inet_ntop(AF_INET6, key->ip2, dst_ip, sizeof(dst_ip));
+  uint16_t src_port = rte_be_to_cpu_16(key->port1);
+  uint16_t dst_port = rte_be_to_cpu_16(key->port2);
+
+  if (qi >= 0) {
+    snprintf(result, result_length, "[%s]:%u-(%u)-[%s]:%u - p%uq%d",
+             src_ip, src_port, key->proto, dst_ip, dst_port, port_id, qi);
+  } else {
+    snprintf(result, result_length, "[%s]:%u-(%u)-[%s]:%u - p%u",
+             src_ip, src_port, key->proto, dst_ip, dst_port, port_id);
+  }
+}
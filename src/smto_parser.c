@@ -0,0 +1,490 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2022 Chenming C (ccm@ccm.ink)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <immintrin.h>
+#include <rte_cpuflags.h>
+#include <rte_prefetch.h>
+#include "internal/smto_parser.h"
+
+/// The quantity of packets extracted at a time by the AVX2 kernel.
+#define AVX2_GROUP_SIZE 4
+
+/// The quantity of packets extracted at a time by the AVX-512 kernel.
+#define AVX512_GROUP_SIZE 8
+
+/// The offset of the 16 bytes which contain the ipv4 5-tuple from the ipv4 header.
+#define IPV4_TUPLE_OFFSET offsetof(struct rte_ipv4_hdr, time_to_live)
+
+/// Drop the ttl and checksum, copy the protocol to the first byte and clear the prefix, which holds the flow scope.
+#define IPV4_TUPLE_SHUFFLE 1, -128, -128, -128, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+
+/// The length of GRE header without any optional field.
+#define GRE_BASE_LENGTH 4
+
+/// The length of each optional field of GRE header.
+#define GRE_OPTION_LENGTH 4
+
+/// The length of l2 header indexed by the l2 packet type, so the VLAN tags are skipped without branch.
+static const uint8_t l2_len_table[RTE_PTYPE_L2_MASK + 1] = {
+    [0 ... RTE_PTYPE_L2_MASK] = sizeof(struct rte_ether_hdr),
+    [RTE_PTYPE_L2_ETHER_VLAN] = sizeof(struct rte_ether_hdr) + sizeof(struct rte_vlan_hdr),
+    [RTE_PTYPE_L2_ETHER_QINQ] = sizeof(struct rte_ether_hdr) + 2 * sizeof(struct rte_vlan_hdr),
+};
+
+/**
+ * Get the length of l2 header including the 802.1Q or QinQ tags by the packet type.
+ */
+static __rte_always_inline uint8_t get_l2_len(const struct rte_mbuf *pkt_mbuf) {
+  return l2_len_table[pkt_mbuf->packet_type & RTE_PTYPE_L2_MASK];
+}
+
+/**
+ * Get the VLAN IDs of a packet as the scope of its flows, see set_tuple_scope(). Both tags are always loaded, they
+ * are inside the l3 header of the packets with fewer tags, and the unused ones are masked out without branch.
+ *
+ * @param pkt_mbuf The packet.
+ * @param vlan_depth The quantity of VLAN tags.
+ * @return The VLAN IDs.
+ */
+static __rte_always_inline uint32_t get_vlan_scope(struct rte_mbuf *pkt_mbuf, uint8_t vlan_depth) {
+  const struct rte_vlan_hdr *vlan_hdrs = rte_pktmbuf_mtod_offset(pkt_mbuf, const struct rte_vlan_hdr *,
+                                                                 sizeof(struct rte_ether_hdr));
+  uint32_t outer_id = rte_be_to_cpu_16(vlan_hdrs[0].vlan_tci) & RTE_LEN2MASK(VLAN_ID_BITS, uint32_t);
+  uint32_t inner_id = rte_be_to_cpu_16(vlan_hdrs[1].vlan_tci) & RTE_LEN2MASK(VLAN_ID_BITS, uint32_t);
+  uint32_t is_qinq = vlan_depth >> 1;
+  uint32_t scope = outer_id << (VLAN_ID_BITS * is_qinq) | (inner_id & -is_qinq);
+  return scope & -(uint32_t) (vlan_depth != 0);
+}
+
+/**
+ * Load the 16 bytes which contain the ipv4 5-tuple.
+ */
+static __rte_always_inline __m128i load_ipv4_tuple(struct rte_mbuf *pkt_mbuf) {
+  return _mm_loadu_si128(rte_pktmbuf_mtod_offset(pkt_mbuf, __m128i *, get_l2_len(pkt_mbuf) + IPV4_TUPLE_OFFSET));
+}
+
+/**
+ * Extract ipv4 5 tuple from the mbuf by SSSE3 instruction.
+ *
+ * @param m0 The mbuf memory.
+ * @param shuffle The shuffle to convert the header into the tuple.
+ * @param key The result.
+ */
+static __rte_always_inline void get_ipv4_5tuple(struct rte_mbuf *m0, __m128i shuffle, struct smto_flow_key *key) {
+  key->xmm = _mm_shuffle_epi8(load_ipv4_tuple(m0), shuffle);
+}
+
+/**
+ * Check whether the packet can be classified by the ipv4 5-tuple flow table.
+ *
+ * @param pkt_mbuf The packet.
+ * @return true if the packet is an ipv4 TCP/UDP packet.
+ */
+static __rte_always_inline bool is_supported_packet(struct rte_mbuf *pkt_mbuf) {
+  uint32_t l4_type = pkt_mbuf->packet_type & RTE_PTYPE_L4_MASK;
+  return RTE_ETH_IS_IPV4_HDR(pkt_mbuf->packet_type) && (l4_type == RTE_PTYPE_L4_TCP || l4_type == RTE_PTYPE_L4_UDP);
+}
+
+/**
+ * Check the packet types of four packets in one pass, the same rule as is_supported_packet().
+ *
+ * @param ptypes The packet types.
+ * @return The bit i is set if the packet i is supported.
+ */
+static __rte_always_inline int supported_packet_mask_x4(__m128i ptypes) {
+  __m128i l3_type = _mm_and_si128(ptypes, _mm_set1_epi32(RTE_PTYPE_L3_IPV4));
+  __m128i l4_type = _mm_and_si128(ptypes, _mm_set1_epi32(RTE_PTYPE_L4_MASK));
+  __m128i is_ipv4 = _mm_cmpeq_epi32(l3_type, _mm_set1_epi32(RTE_PTYPE_L3_IPV4));
+  __m128i is_tcp_udp = _mm_or_si128(_mm_cmpeq_epi32(l4_type, _mm_set1_epi32(RTE_PTYPE_L4_TCP)),
+                                    _mm_cmpeq_epi32(l4_type, _mm_set1_epi32(RTE_PTYPE_L4_UDP)));
+  return _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(is_ipv4, is_tcp_udp)));
+}
+
+/**
+ * Check the packet types of eight packets in one pass, the same rule as is_supported_packet().
+ *
+ * @param ptypes The packet types.
+ * @return The bit i is set if the packet i is supported.
+ */
+__attribute__((target("avx2")))
+static inline int supported_packet_mask_x8(__m256i ptypes) {
+  __m256i l3_type = _mm256_and_si256(ptypes, _mm256_set1_epi32(RTE_PTYPE_L3_IPV4));
+  __m256i l4_type = _mm256_and_si256(ptypes, _mm256_set1_epi32(RTE_PTYPE_L4_MASK));
+  __m256i is_ipv4 = _mm256_cmpeq_epi32(l3_type, _mm256_set1_epi32(RTE_PTYPE_L3_IPV4));
+  __m256i is_tcp_udp = _mm256_or_si256(_mm256_cmpeq_epi32(l4_type, _mm256_set1_epi32(RTE_PTYPE_L4_TCP)),
+                                       _mm256_cmpeq_epi32(l4_type, _mm256_set1_epi32(RTE_PTYPE_L4_UDP)));
+  return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(is_ipv4, is_tcp_udp)));
+}
+
+/**
+ * Prefetch the headers of packets in [from, to).
+ */
+static __rte_always_inline void prefetch_headers(struct rte_mbuf **mbufs, uint16_t from, uint16_t to, uint16_t nb_pkts) {
+  for (uint16_t i = from; i < to && i < nb_pkts; i++) {
+    rte_prefetch0(rte_pktmbuf_mtod(mbufs[i], void *));
+  }
+}
+
+/**
+ * Store an extracted tuple and only keep it if the packet is supported, which compacts the tuples without branch.
+ */
+#define STORE_TUPLE(data, index, is_supported) do { \
+  _mm_store_si128(&tuples[nb_tuple].xmm, (data)); \
+  pkt_indexes[nb_tuple] = (index); \
+  nb_tuple += (is_supported); \
+} while (0)
+
+/**
+ * Extract the tuples packet by packet with SSE, which is the fallback kernel and used to handle the tail of a burst.
+ */
+static __rte_always_inline uint16_t extract_ipv4_tuples_scalar(struct rte_mbuf **mbufs,
+                                                               uint16_t from,
+                                                               uint16_t nb_pkts,
+                                                               struct smto_flow_key *tuples,
+                                                               uint16_t *pkt_indexes,
+                                                               uint16_t nb_tuple) {
+  for (uint16_t i = from; i < nb_pkts; i++) {
+    prefetch_headers(mbufs, i + PREFETCH_OFFSET, i + PREFETCH_OFFSET + 1, nb_pkts);
+    if (unlikely(!is_supported_packet(mbufs[i]))) {
+      continue;
+    }
+    get_ipv4_5tuple(mbufs[i], _mm_setr_epi8(IPV4_TUPLE_SHUFFLE), &tuples[nb_tuple]);
+    pkt_indexes[nb_tuple++] = i;
+  }
+  return nb_tuple;
+}
+
+/**
+ * Extract the inner ipv4 5-tuple and the VNI of a tunneled packet, and set the header lengths of mbuf as the tunnel
+ * tx offloads expect: outer_l2_len and outer_l3_len for the outer headers, l2_len for the outer l4 header, the
+ * tunnel header and the inner ethernet header, and l3_len for the inner ipv4 header.
+ *
+ * @param pkt_mbuf The packet.
+ * @param outer_ipv4_hdr The outer ipv4 header.
+ * @param tuple The result, which is untouched if the packet is not a supported tunnel packet.
+ * @return true if the inner tuple is extracted.
+ */
+static bool parse_tunnel(struct rte_mbuf *pkt_mbuf, struct rte_ipv4_hdr *outer_ipv4_hdr, struct smto_flow_key *tuple) {
+  uint8_t outer_l2_len = (uint8_t *) outer_ipv4_hdr - rte_pktmbuf_mtod(pkt_mbuf, uint8_t *);
+  uint8_t outer_l3_len = rte_ipv4_hdr_len(outer_ipv4_hdr);
+  uint8_t *tunnel_hdr = (uint8_t *) outer_ipv4_hdr + outer_l3_len;
+  /// The length of the first segment from the outer l4 header, each header is only read if it is in the segment
+  uint16_t outer_len = RTE_MIN(outer_l2_len + outer_l3_len, rte_pktmbuf_data_len(pkt_mbuf));
+  uint16_t tunnel_data_len = rte_pktmbuf_data_len(pkt_mbuf) - outer_len;
+  const uint8_t *vni;
+  uint16_t tunnel_len; ///< The length from the outer l4 header to the inner l3 header.
+  uint8_t tunnel_type;
+  bool has_inner_ether = true;
+
+  if (outer_ipv4_hdr->next_proto_id == IPPROTO_UDP) {
+    struct rte_udp_hdr *udp_hdr = (struct rte_udp_hdr *) tunnel_hdr;
+    if (sizeof(struct rte_udp_hdr) > tunnel_data_len) {
+      return false;
+    }
+    if (udp_hdr->dst_port == RTE_BE16(RTE_VXLAN_DEFAULT_PORT)) {
+      if (sizeof(struct rte_udp_hdr) + sizeof(struct rte_vxlan_hdr) > tunnel_data_len) {
+        return false;
+      }
+      struct rte_vxlan_hdr *vxlan_hdr = (struct rte_vxlan_hdr *) (udp_hdr + 1);
+      tunnel_type = SMTO_TUNNEL_VXLAN;
+      vni = (const uint8_t *) &vxlan_hdr->vx_vni;
+      tunnel_len = sizeof(struct rte_udp_hdr) + sizeof(struct rte_vxlan_hdr);
+    } else if (udp_hdr->dst_port == RTE_BE16(RTE_GENEVE_DEFAULT_PORT)) {
+      if (sizeof(struct rte_udp_hdr) + sizeof(struct rte_geneve_hdr) > tunnel_data_len) {
+        return false;
+      }
+      struct rte_geneve_hdr *geneve_hdr = (struct rte_geneve_hdr *) (udp_hdr + 1);
+      if (geneve_hdr->proto != RTE_BE16(RTE_ETHER_TYPE_TEB)) {
+        return false;
+      }
+      tunnel_type = SMTO_TUNNEL_GENEVE;
+      vni = geneve_hdr->vni;
+      tunnel_len = sizeof(struct rte_udp_hdr) + sizeof(struct rte_geneve_hdr) + geneve_hdr->opt_len * 4;
+    } else {
+      return false;
+    }
+  } else if (outer_ipv4_hdr->next_proto_id == IPPROTO_GRE) {
+    struct rte_gre_hdr *gre_hdr = (struct rte_gre_hdr *) tunnel_hdr;
+    if (GRE_BASE_LENGTH > tunnel_data_len || gre_hdr->ver != 0) {
+      return false;
+    }
+    /// The optional fields are checksum, key and sequence number in order
+    tunnel_len = GRE_BASE_LENGTH + (gre_hdr->c + gre_hdr->k + gre_hdr->s) * GRE_OPTION_LENGTH;
+    if (tunnel_len > tunnel_data_len) {
+      return false;
+    }
+    static const uint8_t zero_vni[3] = {0};
+    vni = gre_hdr->k ? tunnel_hdr + GRE_BASE_LENGTH + gre_hdr->c * GRE_OPTION_LENGTH : zero_vni;
+    if (gre_hdr->proto == RTE_BE16(RTE_ETHER_TYPE_TEB) && gre_hdr->k) {
+      tunnel_type = SMTO_TUNNEL_NVGRE;
+    } else if (gre_hdr->proto == RTE_BE16(RTE_ETHER_TYPE_IPV4)) {
+      tunnel_type = gre_hdr->k ? SMTO_TUNNEL_GRE : SMTO_TUNNEL_GRE_NO_KEY;
+      has_inner_ether = false;
+    } else {
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  if (has_inner_ether) {
+    if (tunnel_len + sizeof(struct rte_ether_hdr) > tunnel_data_len) {
+      return false;
+    }
+    struct rte_ether_hdr *inner_eth_hdr = (struct rte_ether_hdr *) (tunnel_hdr + tunnel_len);
+    if (inner_eth_hdr->ether_type != RTE_BE16(RTE_ETHER_TYPE_IPV4)) {
+      return false;
+    }
+    tunnel_len += sizeof(struct rte_ether_hdr);
+  }
+
+  /// Only ipv4 tcp/udp inner packets are supported, and the inner ports must be in the first segment
+  if (tunnel_len + sizeof(struct rte_ipv4_hdr) > tunnel_data_len) {
+    return false;
+  }
+  struct rte_ipv4_hdr *inner_ipv4_hdr = (struct rte_ipv4_hdr *) (tunnel_hdr + tunnel_len);
+  uint8_t inner_l3_len = rte_ipv4_hdr_len(inner_ipv4_hdr);
+  if ((inner_ipv4_hdr->next_proto_id != IPPROTO_TCP && inner_ipv4_hdr->next_proto_id != IPPROTO_UDP)
+      || tunnel_len + inner_l3_len + sizeof(struct rte_udp_hdr) > tunnel_data_len) {
+    return false;
+  }
+  /// The ports are at the same offset of tcp and udp header
+  struct rte_udp_hdr *inner_l4_hdr = (struct rte_udp_hdr *) ((uint8_t *) inner_ipv4_hdr + inner_l3_len);
+
+  tuple->tuple.proto = inner_ipv4_hdr->next_proto_id;
+  rte_memcpy(tuple->tuple.prefix, vni, sizeof(tuple->tuple.prefix));
+  tuple->vlan_depth = 0;
+  tuple->tuple.ip1 = inner_ipv4_hdr->src_addr;
+  tuple->tuple.ip2 = inner_ipv4_hdr->dst_addr;
+  tuple->tuple.port1 = inner_l4_hdr->src_port;
+  tuple->tuple.port2 = inner_l4_hdr->dst_port;
+  tuple->tunnel_type = tunnel_type;
+
+  pkt_mbuf->outer_l2_len = outer_l2_len;
+  pkt_mbuf->outer_l3_len = outer_l3_len;
+  pkt_mbuf->l2_len = tunnel_len;
+  pkt_mbuf->l3_len = inner_l3_len;
+  return true;
+}
+
+/**
+ * Record the header lengths into mbuf and the VLAN IDs into the tuples, and reload the ports of the packets with ipv4
+ * options, which are rare and loaded at the fixed offset by the kernels. The packets to the udp ports of VXLAN and
+ * GENEVE are classified by their inner tuples.
+ *
+ * @return The quantity of extracted tuples.
+ */
+static __rte_always_inline uint16_t apply_ipv4_headers(struct rte_mbuf **mbufs,
+                                                       struct smto_flow_key *tuples,
+                                                       const uint16_t *pkt_indexes,
+                                                       uint16_t nb_tuple) {
+  for (uint16_t i = 0; i < nb_tuple; i++) {
+    struct rte_mbuf *pkt_mbuf = mbufs[pkt_indexes[i]];
+    uint8_t l2_len = get_l2_len(pkt_mbuf);
+    struct rte_ipv4_hdr *ipv4_hdr = rte_pktmbuf_mtod_offset(pkt_mbuf, struct rte_ipv4_hdr *, l2_len);
+    tuples[i].tunnel_type = SMTO_TUNNEL_NONE;
+    tuples[i].vlan_depth = (l2_len - sizeof(struct rte_ether_hdr)) / sizeof(struct rte_vlan_hdr);
+    set_tuple_scope(tuples[i].tuple.prefix, get_vlan_scope(pkt_mbuf, tuples[i].vlan_depth));
+    pkt_mbuf->outer_l2_len = 0;
+    pkt_mbuf->outer_l3_len = 0;
+    pkt_mbuf->l2_len = l2_len;
+    pkt_mbuf->l3_len = rte_ipv4_hdr_len(ipv4_hdr);
+    if (unlikely(pkt_mbuf->l3_len != sizeof(struct rte_ipv4_hdr))) {
+      /// The ports are at the same offset of tcp and udp header
+      struct rte_udp_hdr *l4_hdr = (struct rte_udp_hdr *) ((char *) ipv4_hdr + pkt_mbuf->l3_len);
+      tuples[i].tuple.port1 = l4_hdr->src_port;
+      tuples[i].tuple.port2 = l4_hdr->dst_port;
+    }
+    if (unlikely(tuples[i].tuple.proto == IPPROTO_UDP
+                     && (tuples[i].tuple.port2 == RTE_BE16(RTE_VXLAN_DEFAULT_PORT)
+                         || tuples[i].tuple.port2 == RTE_BE16(RTE_GENEVE_DEFAULT_PORT)))) {
+      parse_tunnel(pkt_mbuf, ipv4_hdr, &tuples[i]);
+    }
+  }
+  return nb_tuple;
+}
+
+static uint16_t extract_ipv4_tuples_sse(struct rte_mbuf **mbufs,
+                                        uint16_t nb_pkts,
+                                        struct smto_flow_key *tuples,
+                                        uint16_t *pkt_indexes) {
+  prefetch_headers(mbufs, 0, PREFETCH_OFFSET, nb_pkts);
+  uint16_t nb_tuple = extract_ipv4_tuples_scalar(mbufs, 0, nb_pkts, tuples, pkt_indexes, 0);
+  return apply_ipv4_headers(mbufs, tuples, pkt_indexes, nb_tuple);
+}
+
+__attribute__((target("avx2")))
+static uint16_t extract_ipv4_tuples_avx2(struct rte_mbuf **mbufs,
+                                         uint16_t nb_pkts,
+                                         struct smto_flow_key *tuples,
+                                         uint16_t *pkt_indexes) {
+  const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(IPV4_TUPLE_SHUFFLE));
+  uint16_t nb_tuple = 0;
+  uint16_t i = 0;
+
+  prefetch_headers(mbufs, 0, PREFETCH_OFFSET, nb_pkts);
+  for (; i + AVX2_GROUP_SIZE <= nb_pkts; i += AVX2_GROUP_SIZE) {
+    prefetch_headers(mbufs, i + PREFETCH_OFFSET, i + PREFETCH_OFFSET + AVX2_GROUP_SIZE, nb_pkts);
+    int supported = supported_packet_mask_x4(_mm_setr_epi32((int) mbufs[i]->packet_type,
+                                                            (int) mbufs[i + 1]->packet_type,
+                                                            (int) mbufs[i + 2]->packet_type,
+                                                            (int) mbufs[i + 3]->packet_type));
+
+    /// Each register holds the tuples of two packets
+    __m256i tuple01 = _mm256_inserti128_si256(_mm256_castsi128_si256(load_ipv4_tuple(mbufs[i])),
+                                              load_ipv4_tuple(mbufs[i + 1]), 1);
+    __m256i tuple23 = _mm256_inserti128_si256(_mm256_castsi128_si256(load_ipv4_tuple(mbufs[i + 2])),
+                                              load_ipv4_tuple(mbufs[i + 3]), 1);
+    tuple01 = _mm256_shuffle_epi8(tuple01, shuffle);
+    tuple23 = _mm256_shuffle_epi8(tuple23, shuffle);
+
+    STORE_TUPLE(_mm256_castsi256_si128(tuple01), i, supported & 1);
+    STORE_TUPLE(_mm256_extracti128_si256(tuple01, 1), i + 1, (supported >> 1) & 1);
+    STORE_TUPLE(_mm256_castsi256_si128(tuple23), i + 2, (supported >> 2) & 1);
+    STORE_TUPLE(_mm256_extracti128_si256(tuple23, 1), i + 3, (supported >> 3) & 1);
+  }
+  nb_tuple = extract_ipv4_tuples_scalar(mbufs, i, nb_pkts, tuples, pkt_indexes, nb_tuple);
+  return apply_ipv4_headers(mbufs, tuples, pkt_indexes, nb_tuple);
+}
+
+__attribute__((target("avx2,avx512f,avx512bw")))
+static uint16_t extract_ipv4_tuples_avx512(struct rte_mbuf **mbufs,
+                                           uint16_t nb_pkts,
+                                           struct smto_flow_key *tuples,
+                                           uint16_t *pkt_indexes) {
+  const __m512i shuffle = _mm512_broadcast_i32x4(_mm_setr_epi8(IPV4_TUPLE_SHUFFLE));
+  uint16_t nb_tuple = 0;
+  uint16_t i = 0;
+
+  prefetch_headers(mbufs, 0, PREFETCH_OFFSET, nb_pkts);
+  for (; i + AVX512_GROUP_SIZE <= nb_pkts; i += AVX512_GROUP_SIZE) {
+    prefetch_headers(mbufs, i + PREFETCH_OFFSET, i + PREFETCH_OFFSET + AVX512_GROUP_SIZE, nb_pkts);
+    int supported = supported_packet_mask_x8(_mm256_setr_epi32((int) mbufs[i]->packet_type,
+                                                               (int) mbufs[i + 1]->packet_type,
+                                                               (int) mbufs[i + 2]->packet_type,
+                                                               (int) mbufs[i + 3]->packet_type,
+                                                               (int) mbufs[i + 4]->packet_type,
+                                                               (int) mbufs[i + 5]->packet_type,
+                                                               (int) mbufs[i + 6]->packet_type,
+                                                               (int) mbufs[i + 7]->packet_type));
+
+    /// Each register holds the tuples of four packets
+    __m512i tuple0123 = _mm512_castsi128_si512(load_ipv4_tuple(mbufs[i]));
+    tuple0123 = _mm512_inserti32x4(tuple0123, load_ipv4_tuple(mbufs[i + 1]), 1);
+    tuple0123 = _mm512_inserti32x4(tuple0123, load_ipv4_tuple(mbufs[i + 2]), 2);
+    tuple0123 = _mm512_inserti32x4(tuple0123, load_ipv4_tuple(mbufs[i + 3]), 3);
+    __m512i tuple4567 = _mm512_castsi128_si512(load_ipv4_tuple(mbufs[i + 4]));
+    tuple4567 = _mm512_inserti32x4(tuple4567, load_ipv4_tuple(mbufs[i + 5]), 1);
+    tuple4567 = _mm512_inserti32x4(tuple4567, load_ipv4_tuple(mbufs[i + 6]), 2);
+    tuple4567 = _mm512_inserti32x4(tuple4567, load_ipv4_tuple(mbufs[i + 7]), 3);
+    tuple0123 = _mm512_shuffle_epi8(tuple0123, shuffle);
+    tuple4567 = _mm512_shuffle_epi8(tuple4567, shuffle);
+
+    STORE_TUPLE(_mm512_castsi512_si128(tuple0123), i, supported & 1);
+    STORE_TUPLE(_mm512_extracti32x4_epi32(tuple0123, 1), i + 1, (supported >> 1) & 1);
+    STORE_TUPLE(_mm512_extracti32x4_epi32(tuple0123, 2), i + 2, (supported >> 2) & 1);
+    STORE_TUPLE(_mm512_extracti32x4_epi32(tuple0123, 3), i + 3, (supported >> 3) & 1);
+    STORE_TUPLE(_mm512_castsi512_si128(tuple4567), i + 4, (supported >> 4) & 1);
+    STORE_TUPLE(_mm512_extracti32x4_epi32(tuple4567, 1), i + 5, (supported >> 5) & 1);
+    STORE_TUPLE(_mm512_extracti32x4_epi32(tuple4567, 2), i + 6, (supported >> 6) & 1);
+    STORE_TUPLE(_mm512_extracti32x4_epi32(tuple4567, 3), i + 7, (supported >> 7) & 1);
+  }
+  nb_tuple = extract_ipv4_tuples_scalar(mbufs, i, nb_pkts, tuples, pkt_indexes, nb_tuple);
+  return apply_ipv4_headers(mbufs, tuples, pkt_indexes, nb_tuple);
+}
+
+extract_tuples_t extract_ipv4_tuples = extract_ipv4_tuples_sse;
+
+uint16_t extract_ipv6_tuples(struct rte_mbuf **mbufs,
+                             uint16_t nb_pkts,
+                             struct smto_flow_key *tuples,
+                             uint16_t *pkt_indexes) {
+  uint16_t nb_tuple = 0;
+  for (uint16_t i = 0; i < nb_pkts; i++) {
+    struct rte_mbuf *pkt_mbuf = mbufs[i];
+    uint32_t l4_type = pkt_mbuf->packet_type & RTE_PTYPE_L4_MASK;
+    if (likely(!RTE_ETH_IS_IPV6_HDR(pkt_mbuf->packet_type))
+        || (l4_type != RTE_PTYPE_L4_TCP && l4_type != RTE_PTYPE_L4_UDP)) {
+      continue;
+    }
+    uint8_t l2_len = get_l2_len(pkt_mbuf);
+    struct rte_ipv6_hdr *ipv6_hdr = rte_pktmbuf_mtod_offset(pkt_mbuf, struct rte_ipv6_hdr *, l2_len);
+    /// The l4 header must follow the fixed header
+    if (unlikely(ipv6_hdr->proto != IPPROTO_TCP && ipv6_hdr->proto != IPPROTO_UDP)) {
+      continue;
+    }
+    struct smto_ipv6_tuple *tuple = &tuples[nb_tuple].tuple6;
+    _mm_storeu_si128((__m128i *) tuple->ip1, _mm_loadu_si128((const __m128i *) ipv6_hdr->src_addr));
+    _mm_storeu_si128((__m128i *) tuple->ip2, _mm_loadu_si128((const __m128i *) ipv6_hdr->dst_addr));
+    /// The ports are at the same offset of tcp and udp header
+    struct rte_udp_hdr *l4_hdr = (struct rte_udp_hdr *) (ipv6_hdr + 1);
+    tuple->port1 = l4_hdr->src_port;
+    tuple->port2 = l4_hdr->dst_port;
+    tuple->proto = ipv6_hdr->proto;
+    tuples[nb_tuple].is_ipv6 = true;
+    tuples[nb_tuple].tunnel_type = SMTO_TUNNEL_NONE;
+    tuples[nb_tuple].vlan_depth = (l2_len - sizeof(struct rte_ether_hdr)) / sizeof(struct rte_vlan_hdr);
+    set_tuple_scope(tuple->prefix, get_vlan_scope(pkt_mbuf, tuples[nb_tuple].vlan_depth));
+    pkt_mbuf->outer_l2_len = 0;
+    pkt_mbuf->outer_l3_len = 0;
+    pkt_mbuf->l2_len = l2_len;
+    pkt_mbuf->l3_len = sizeof(struct rte_ipv6_hdr);
+    pkt_indexes[nb_tuple++] = i;
+  }
+  return nb_tuple;
+}
+
+uint16_t extract_gre_tuples(struct rte_mbuf **mbufs,
+                            uint16_t nb_pkts,
+                            struct smto_flow_key *tuples,
+                            uint16_t *pkt_indexes) {
+  uint16_t nb_tuple = 0;
+  for (uint16_t i = 0; i < nb_pkts; i++) {
+    struct rte_mbuf *pkt_mbuf = mbufs[i];
+    uint32_t l4_type = pkt_mbuf->packet_type & RTE_PTYPE_L4_MASK;
+    /// The tcp/udp packets have been extracted by extract_ipv4_tuples()
+    if (likely(!RTE_ETH_IS_IPV4_HDR(pkt_mbuf->packet_type))
+        || l4_type == RTE_PTYPE_L4_TCP || l4_type == RTE_PTYPE_L4_UDP) {
+      continue;
+    }
+    struct rte_ipv4_hdr *ipv4_hdr = rte_pktmbuf_mtod_offset(pkt_mbuf, struct rte_ipv4_hdr *, get_l2_len(pkt_mbuf));
+    if (ipv4_hdr->next_proto_id == IPPROTO_GRE && parse_tunnel(pkt_mbuf, ipv4_hdr, &tuples[nb_tuple])) {
+      pkt_indexes[nb_tuple++] = i;
+    }
+  }
+  return nb_tuple;
+}
+
+void init_parser(zlog_category_t *logger) {
+  if (rte_cpu_get_flag_enabled(RTE_CPUFLAG_AVX512F) > 0 && rte_cpu_get_flag_enabled(RTE_CPUFLAG_AVX512BW) > 0) {
+    extract_ipv4_tuples = extract_ipv4_tuples_avx512;
+    zlog_info(logger, "use AVX-512 kernel to extract 5-tuples");
+  } else if (rte_cpu_get_flag_enabled(RTE_CPUFLAG_AVX2) > 0) {
+    extract_ipv4_tuples = extract_ipv4_tuples_avx2;
+    zlog_info(logger, "use AVX2 kernel to extract 5-tuples");
+  } else {
+    extract_ipv4_tuples = extract_ipv4_tuples_sse;
+    zlog_info(logger, "use SSE kernel to extract 5-tuples");
+  }
+}
@@ -22,10 +22,35 @@
  * SOFTWARE.
 */
 
+#include <string.h>
+#include <arpa/inet.h>
 #include "internal/smto_setup.h"
+#include "internal/smto_flow_key.h"
 
 extern struct smto *smto_cb;
 
+uint16_t get_max_queue_quantity(uint16_t port_id) {
+  struct rte_eth_dev_info dev_info;
+  int ret = rte_eth_dev_info_get(port_id, &dev_info);
+  if (ret != 0) {
+    zlog_error(smto_cb->logger, "failed to get the device info of port %d: %s", port_id, rte_strerror(ret));
+    return 0;
+  }
+  uint16_t max_queue_quantity = RTE_MIN(dev_info.max_rx_queues, dev_info.max_tx_queues);
+  return max_queue_quantity > 1 ? max_queue_quantity - 1 : 0;
+}
+
+bool has_tx_cksum_offload(uint16_t port_id) {
+  const uint64_t cksum_offloads = DEV_TX_OFFLOAD_IPV4_CKSUM | DEV_TX_OFFLOAD_UDP_CKSUM | DEV_TX_OFFLOAD_TCP_CKSUM;
+  struct rte_eth_dev_info dev_info;
+  int ret = rte_eth_dev_info_get(port_id, &dev_info);
+  if (ret != 0) {
+    zlog_error(smto_cb->logger, "failed to get the device info of port %d: %s", port_id, rte_strerror(ret));
+    return false;
+  }
+  return (dev_info.tx_offload_capa & cksum_offloads) == cksum_offloads;
+}
+
 int init_port(uint16_t port_id) {
   int ret = 0;
 
@@ -45,8 +70,15 @@ int init_port(uint16_t port_id) {
   /// Configure the network port
   struct rte_eth_conf port_conf = {
       .rxmode = {
+          .mq_mode = ETH_MQ_RX_RSS,
           .split_hdr_size = 0,
       },
+      .rx_adv_conf = {
+          .rss_conf = {
+              .rss_key = NULL,
+              .rss_hf = ETH_RSS_IP,
+          },
+      },
       .txmode = {
           .offloads =
           DEV_TX_OFFLOAD_VLAN_INSERT |
@@ -58,15 +90,29 @@ int init_port(uint16_t port_id) {
       },
   };
   port_conf.txmode.offloads &= dev_info.tx_offload_capa;
+  port_conf.rx_adv_conf.rss_conf.rss_hf &= dev_info.flow_type_rss_offloads;
+  if (smto_cb->queue_quantity == 1 || port_conf.rx_adv_conf.rss_conf.rss_hf == 0) {
+    port_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+  }
+
+#ifdef ADAPTIVE_POLL
+  /// Let the idle workers wait for the rx interrupt
+  port_conf.intr_conf.rxq = 1;
+#endif
 
   /// The additional one is used for hairpin
-  ret = rte_eth_dev_configure(port_id, GENERAL_QUEUES_QUANTITY + 1, GENERAL_QUEUES_QUANTITY + 1, &port_conf);
+  ret = rte_eth_dev_configure(port_id, smto_cb->queue_quantity + 1, smto_cb->queue_quantity + 1, &port_conf);
+  if (ret != 0 && port_conf.intr_conf.rxq) {
+    zlog_warn(smto_cb->logger, "port %d does not support rx interrupt: %s", port_id, rte_strerror(-ret));
+    port_conf.intr_conf.rxq = 0;
+    ret = rte_eth_dev_configure(port_id, smto_cb->queue_quantity + 1, smto_cb->queue_quantity + 1, &port_conf);
+  }
   if (ret != 0) {
     zlog_error(smto_cb->logger, "can not change the configuration of port %d: %s", port_id, rte_strerror(ret));
     return SMTO_ERROR_DEVICE_CONFIGURE;
   }
 
-  for (int i = 0; i < GENERAL_QUEUES_QUANTITY; ++i) {
+  for (int i = 0; i < smto_cb->queue_quantity; ++i) {
     ret = rte_eth_rx_queue_setup(port_id,
                                  i,
                                  QUEUE_DESC_NUMBER,
@@ -79,7 +125,7 @@ int init_port(uint16_t port_id) {
     }
   }
 
-  for (int i = 0; i < GENERAL_QUEUES_QUANTITY; ++i) {
+  for (int i = 0; i < smto_cb->queue_quantity; ++i) {
     ret = rte_eth_tx_queue_setup(port_id,
                                  i,
                                  QUEUE_DESC_NUMBER,
@@ -136,9 +182,9 @@ static int setup_hairpin_queues(uint16_t port_id, uint16_t peer_port_id) {
 
   /// create hairpin queues on both ports
   hairpin_conf.peers[0].port = peer_port_id;
-  hairpin_conf.peers[0].queue = HAIRPIN_QUEUE_INDEX;
+  hairpin_conf.peers[0].queue = smto_cb->queue_quantity;
   ret = rte_eth_tx_hairpin_queue_setup(
-      port_id, HAIRPIN_QUEUE_INDEX,
+      port_id, smto_cb->queue_quantity,
       0, &hairpin_conf);
   if (ret != 0) {
     zlog_error(smto_cb->logger, "can not setup the hairpin tx queue of port %d: %s", port_id, rte_strerror(ret));
@@ -146,9 +192,9 @@ static int setup_hairpin_queues(uint16_t port_id, uint16_t peer_port_id) {
   }
 
   hairpin_conf.peers[0].port = peer_port_id;
-  hairpin_conf.peers[0].queue = HAIRPIN_QUEUE_INDEX;
+  hairpin_conf.peers[0].queue = smto_cb->queue_quantity;
   ret = rte_eth_rx_hairpin_queue_setup(
-      peer_port_id, HAIRPIN_QUEUE_INDEX,
+      peer_port_id, smto_cb->queue_quantity,
       0, &hairpin_conf);
   if (ret != 0) {
     zlog_error(smto_cb->logger, "can not setup the hairpin rx queue of port %d: %s", peer_port_id, rte_strerror(ret));
@@ -184,32 +230,260 @@ int setup_two_port_hairpin(int port_id, int peer_port_id) {
   return SMTO_SUCCESS;
 }
 
-int destroy_hash_map() {
-  if (smto_cb->flow_hash_map != NULL) {
-    int ret = 0;
-    int key_count = rte_hash_count(smto_cb->flow_hash_map);
-    zlog_debug(smto_cb->logger, "%d flow keys has been added into flow hash map", key_count);
+/**
+ * Return a flow key pair to the pool once no packet worker can hold it, called by the defer queue of a flow table
+ * after the grace period of a deleted key. The in-direction key is always deleted after the out-direction one, so the
+ * pair is returned with it, or with the out-direction key if the in-direction one has never been added.
+ *
+ * @param p Unused.
+ * @param key_data The flow key of the deleted key.
+ */
+static void free_flow_key_pair(void *p, void *key_data) {
+  RTE_SET_USED(p);
+  struct smto_flow_key *flow_key = (struct smto_flow_key *) key_data;
+  if (flow_key->symmetrical_flow_key == NULL) {
+    rte_mempool_put(smto_cb->flow_key_pool, flow_key);
+  } else if (flow_key > flow_key->symmetrical_flow_key) {
+    rte_mempool_put(smto_cb->flow_key_pool, get_flow_key_pair(flow_key));
+  }
+}
+
+/**
+ * Create a flow table, which is one shared table or one single-writer shard for each packet worker.
+ *
+ * @param flow_hash_maps The tables to create, flow_hash_map_quantity of them are created.
+ * @param prefix The prefix of table names.
+ * @param entries The total entries of the table.
+ * @param key_len The length of the key.
+ * @return 0 on success, other on error.
+ */
+static int create_flow_table(struct rte_hash **flow_hash_maps, const char *prefix, uint32_t entries, uint32_t key_len) {
+  char name[RTE_HASH_NAMESIZE];
+  struct rte_hash_parameters flow_hash_map_parameter = {
+      .name = name,
+      .entries = entries,
+      .key_len = key_len,
+#ifdef EM_HASH_CRC
+      .hash_func = rte_hash_crc,
+#else
+      .hash_func = rte_jhash,
+#endif
+      .hash_func_init_val = 622,
+      .socket_id = (int) rte_socket_id(),
+      .extra_flag = RTE_HASH_EXTRA_FLAGS_RW_CONCURRENCY_LF | RTE_HASH_EXTRA_FLAGS_MULTI_WRITER_ADD
+  };
+  if (smto_cb->flow_table_sharded) {
+    /// Each shard is only written by its owner, so no concurrency flag is needed
+    flow_hash_map_parameter.entries = entries / smto_cb->flow_hash_map_quantity;
+    flow_hash_map_parameter.extra_flag = 0;
+  }
+
+  for (uint16_t i = 0; i < smto_cb->flow_hash_map_quantity; i++) {
+    snprintf(name, sizeof(name), "%s_%u", prefix, i);
+    flow_hash_maps[i] = rte_hash_create(&flow_hash_map_parameter);
+    if (flow_hash_maps[i] == NULL) {
+      zlog_error(smto_cb->logger, "failed to create flow hash map %s: %s", name, rte_strerror(rte_errno));
+      return SMTO_ERROR_HASH_MAP_CREATION;
+    }
+    /**
+     * The key slots and the flow keys of the deleted keys are reclaimed in batches after the grace period. A deleted
+     * key is leaked if the defer queue is full, which happens while a reader is stuck in a slow rte_flow call, so the
+     * queue holds both directions of every flow key pair which can be in the table.
+     */
+    struct rte_hash_rcu_config rcu_config = {
+        .v = smto_cb->flow_table_rcu,
+        .mode = RTE_HASH_QSBR_MODE_DQ,
+        .dq_size = RTE_MIN(flow_hash_map_parameter.entries, FLOW_KEY_POOL_SIZE * 2),
+        .trigger_reclaim_limit = FLOW_RECLAIM_THRESHOLD,
+        .max_reclaim_size = FLOW_RECLAIM_MAX,
+        .free_key_data_func = free_flow_key_pair,
+    };
+    if (rte_hash_rcu_qsbr_add(flow_hash_maps[i], &rcu_config) != 0) {
+      zlog_error(smto_cb->logger, "failed to add rcu to flow hash map %s: %s", name, rte_strerror(rte_errno));
+      return SMTO_ERROR_HASH_MAP_CREATION;
+    }
+  }
+  return SMTO_SUCCESS;
+}
+
+int create_hash_map() {
+  /// Each packet worker reads the flow tables as the thread of its worker_id, followed by the flow engine and the aged
+  /// event thread, which get the flow keys from the rings and the age contexts of the rte_flows
+  size_t rcu_size = rte_rcu_qsbr_get_memsize(FLOW_TABLE_RCU_THREADS(smto_cb));
+  smto_cb->flow_table_rcu = rte_zmalloc("flow_table_rcu", rcu_size, RTE_CACHE_LINE_SIZE);
+  if (smto_cb->flow_table_rcu == NULL
+      || rte_rcu_qsbr_init(smto_cb->flow_table_rcu, FLOW_TABLE_RCU_THREADS(smto_cb)) != 0) {
+    zlog_error(smto_cb->logger, "failed to create the rcu of flow hash map");
+    return SMTO_ERROR_HASH_MAP_CREATION;
+  }
+
+  smto_cb->flow_hash_map_quantity = smto_cb->flow_table_sharded ? smto_cb->queue_quantity : 1;
+  int ret = create_flow_table(smto_cb->flow_hash_maps, "flow_hash_table",
+                              MAX_HASH_ENTRIES, sizeof(struct rdarm_five_tuple));
+  if (ret != SMTO_SUCCESS) {
+    return ret;
+  }
+  return create_flow_table(smto_cb->flow6_hash_maps, "flow6_hash_table",
+                           MAX_HASH6_ENTRIES, sizeof(struct smto_ipv6_tuple));
+}
+
+/**
+ * Free the flows in a flow table and the table itself.
+ *
+ * @param flow_hash_maps The tables to free, flow_hash_map_quantity of them are freed.
+ */
+static void destroy_flow_table(struct rte_hash **flow_hash_maps) {
+  for (uint16_t i = 0; i < smto_cb->flow_hash_map_quantity; i++) {
+    struct rte_hash *flow_hash_map = flow_hash_maps[i];
+    if (flow_hash_map == NULL) {
+      continue;
+    }
+    int key_count = rte_hash_count(flow_hash_map);
+    zlog_debug(smto_cb->logger, "%d flow keys has been added into flow hash map %u", key_count, i);
     if (key_count > 0) {
+      /**
+       * The packet workers have exited, so the flow keys still in the table are returned to the pool directly. The
+       * keys are not deleted one by one, the table is freed as a whole.
+       */
       const void *key = 0;
       void *data = 0;
-      uint32_t *next = 0;
-      uint32_t current = rte_hash_iterate(smto_cb->flow_hash_map, &key, &data, next);
-      for (; current != -ENOENT; current = rte_hash_iterate(smto_cb->flow_hash_map, &key, &data, next)) {
-        int del_key_position = rte_hash_del_key(smto_cb->flow_hash_map, key);
-        if (del_key_position < 0) {
-          zlog_error(smto_cb->logger,
-                     "failed to delete the key from flow hash map: %s",
-                     rte_strerror(del_key_position));
-          continue;
+      uint32_t next = 0;
+      int32_t current = rte_hash_iterate(flow_hash_map, &key, &data, &next);
+      for (; current >= 0; current = rte_hash_iterate(flow_hash_map, &key, &data, &next)) {
+        /// Both directions share one object, so only return it to the pool with the out-direction key
+        struct smto_flow_key_pair *flow_key_pair = get_flow_key_pair(data);
+        if (data == &flow_key_pair->out) {
+          rte_mempool_put(smto_cb->flow_key_pool, flow_key_pair);
         }
-        ret = rte_hash_free_key_with_position(smto_cb->flow_hash_map, del_key_position);
-        if (ret) {
-          zlog_error(smto_cb->logger, "cannot free a flow key: %s", rte_strerror(ret));
-        }
-        rte_free(data);
       }
     }
-    rte_hash_free(smto_cb->flow_hash_map);
+    /// Also reclaim the deleted keys left in the defer queue, which return their flow keys to the pool
+    rte_hash_free(flow_hash_map);
+    flow_hash_maps[i] = NULL;
+  }
+}
+
+int destroy_hash_map() {
+  destroy_flow_table(smto_cb->flow_hash_maps);
+  destroy_flow_table(smto_cb->flow6_hash_maps);
+  rte_free(smto_cb->flow_table_rcu);
+  smto_cb->flow_table_rcu = NULL;
+  rte_mempool_free(smto_cb->flow_key_pool);
+  smto_cb->flow_key_pool = NULL;
+  return SMTO_SUCCESS;
+}
+
+/**
+ * Create a single-producer/single-consumer ring for each packet worker.
+ *
+ * @param rings The rings to create.
+ * @param prefix The prefix of the ring names.
+ *
+ * @return 0 on success, other on error.
+ */
+static int create_worker_rings(struct rte_ring **rings, const char *prefix) {
+  char name[RTE_RING_NAMESIZE];
+  ssize_t ring_size = rte_ring_get_memsize(MAX_RING_ENTRIES);
+  for (uint16_t i = 0; i < smto_cb->packet_worker_quantity; i++) {
+    snprintf(name, sizeof(name), "%s_%u", prefix, i);
+    rings[i] = rte_calloc(name, ring_size, 1, 0);
+    if (rings[i] == NULL) {
+      zlog_error(smto_cb->logger, "failed to allocate memory for ring %s", name);
+      return SMTO_ERROR_HUGE_PAGE_MEMORY_ALLOCATION;
+    }
+    int ret = rte_ring_init(rings[i], name, MAX_RING_ENTRIES, RING_F_SP_ENQ | RING_F_SC_DEQ);
+    if (ret != 0) {
+      zlog_error(smto_cb->logger, "failed to initialize ring %s: %s", name, rte_strerror(-ret));
+      return SMTO_ERROR_RING_CREATION;
+    }
+  }
+  return SMTO_SUCCESS;
+}
+
+int create_flow_rules_rings() {
+  int ret = create_worker_rings(smto_cb->flow_rules_rings, "flow_rule_ring");
+  if (ret == SMTO_SUCCESS) {
+    ret = create_worker_rings(smto_cb->flow_teardown_rings, "flow_teardown_ring");
+  }
+  if (ret != SMTO_SUCCESS) {
+    destroy_flow_rules_rings();
+  }
+  return ret;
+}
+
+void destroy_flow_rules_rings() {
+  for (uint16_t i = 0; i < RTE_DIM(smto_cb->flow_rules_rings); i++) {
+    rte_free(smto_cb->flow_rules_rings[i]);
+    smto_cb->flow_rules_rings[i] = NULL;
+    rte_free(smto_cb->flow_teardown_rings[i]);
+    smto_cb->flow_teardown_rings[i] = NULL;
+  }
+}
+
+int init_snat_pool(const char *pool) {
+  char buffer[MAX_SNAT_PREFIXES * sizeof("255.255.255.255/32,")];
+  if (strlen(pool) >= sizeof(buffer)) {
+    zlog_error(smto_cb->logger, "the snat pool is too long: %s", pool);
+    return SMTO_ERROR_INVALID_SNAT_POOL;
+  }
+  strcpy(buffer, pool);
+  smto_cb->snat_ip_quantity = 0;
+  smto_cb->snat_prefix_quantity = 0;
+
+  char *save_ptr = NULL;
+  for (char *token = strtok_r(buffer, ", ", &save_ptr); token != NULL; token = strtok_r(NULL, ", ", &save_ptr)) {
+    long depth = 32;
+    char *slash = strchr(token, '/');
+    if (slash != NULL) {
+      *slash = '\0';
+      char *end = NULL;
+      depth = strtol(slash + 1, &end, 10);
+      if (*end != '\0' || depth < 0 || depth > 32) {
+        zlog_error(smto_cb->logger, "invalid prefix length of snat pool: %s", slash + 1);
+        return SMTO_ERROR_INVALID_SNAT_POOL;
+      }
+    }
+    struct in_addr addr;
+    if (inet_pton(AF_INET, token, &addr) != 1) {
+      zlog_error(smto_cb->logger, "invalid address of snat pool: %s", token);
+      return SMTO_ERROR_INVALID_SNAT_POOL;
+    }
+    uint64_t quantity = 1ULL << (32 - depth);
+    if (smto_cb->snat_prefix_quantity == MAX_SNAT_PREFIXES || smto_cb->snat_ip_quantity + quantity > MAX_SNAT_IPS) {
+      zlog_error(smto_cb->logger, "too many addresses in snat pool, at most %u addresses in %u prefixes",
+                 MAX_SNAT_IPS, MAX_SNAT_PREFIXES);
+      return SMTO_ERROR_INVALID_SNAT_POOL;
+    }
+    uint32_t first_ip = rte_be_to_cpu_32(addr.s_addr) & (uint32_t) ~(quantity - 1);
+    smto_cb->snat_prefixes[smto_cb->snat_prefix_quantity++] = (struct smto_snat_prefix) {
+        .ip = first_ip, .depth = (uint8_t) depth};
+    for (uint32_t i = 0; i < quantity; i++) {
+      smto_cb->snat_ips[smto_cb->snat_ip_quantity++] = first_ip + i;
+    }
+  }
+  if (smto_cb->snat_ip_quantity == 0) {
+    zlog_error(smto_cb->logger, "no address in snat pool");
+    return SMTO_ERROR_INVALID_SNAT_POOL;
+  }
+  zlog_info(smto_cb->logger, "snat pool %s has %u addresses", pool, smto_cb->snat_ip_quantity);
+  return SMTO_SUCCESS;
+}
+
+int create_port_allocators(struct worker_parameter *worker, int socket_id) {
+  /// Each packet worker owns a disjoint slice of the NAT ports of every address
+  uint16_t slice = (NAT_PORT_MAX - NAT_PORT_MIN + 1) / smto_cb->packet_worker_quantity;
+  worker->nat_port_first = NAT_PORT_MIN + worker->worker_id * slice;
+  worker->nat_port_last = worker->nat_port_first + slice - 1;
+
+  worker->port_allocators = rte_malloc_socket("port_allocators",
+                                              sizeof(struct smto_port_allocator) * (smto_cb->snat_ip_quantity + 1),
+                                              RTE_CACHE_LINE_SIZE, socket_id);
+  if (worker->port_allocators == NULL) {
+    zlog_error(smto_cb->logger, "failed to allocate the nat port allocators of worker %u", worker->worker_id);
+    return SMTO_ERROR_MEMORY_ALLOCATION;
+  }
+  for (uint16_t i = 0; i <= smto_cb->snat_ip_quantity; i++) {
+    init_port_allocator(&worker->port_allocators[i], worker->nat_port_first, worker->nat_port_last);
   }
   return SMTO_SUCCESS;
 }
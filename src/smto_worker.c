@@ -27,6 +27,8 @@
 #include "internal/smto_flow_key.h"
 #include "internal/smto_flow_engine.h"
 #include "internal/smto_utils.h"
+#include "internal/smto_parser.h"
+#include "internal/smto_checksum.h"
 
 extern struct smto *smto_cb;
 
@@ -36,201 +38,917 @@ extern struct smto *smto_cb;
 //__thread uint64_t flow_used_times[TIME_COUNT];
 //__thread int used_times_index = 0;
 
-static rte_xmm_t ipv4_mask = (rte_xmm_t) {
-    .u32 = {BIT_8_TO_15, ALL_32_BITS,
-            ALL_32_BITS, ALL_32_BITS}};
+/**
+ * Get the tuple of a flow key, which is also the key of the flow table.
+ *
+ * @param flow_key The flow key.
+ * @param is_ipv6 Whether it is an ipv6 flow, always a constant.
+ */
+static __rte_always_inline void *get_tuple(struct smto_flow_key *flow_key, const bool is_ipv6) {
+  return is_ipv6 ? (void *) &flow_key->tuple6 : (void *) &flow_key->tuple;
+}
 
 /**
- * Extract ipv4 5 tuple from the mbuf by SSE3 instruction.
+ * Return the NAT port of a flow to the allocator of the worker which creates it, the tunneled flows take no port.
  *
- * @param m0 The mbuf memory.
- * @param mask0 The position which doesn't need.
- * @param key The result.
+ * @param worker The worker which creates the flow.
+ * @param flow_key The out-direction flow key.
  */
-static __rte_always_inline void get_ipv4_5tuple(struct rte_mbuf *m0, __m128i mask0, struct smto_flow_key *key) {
-  __m128i tmpdata0 = _mm_loadu_si128(
-      rte_pktmbuf_mtod_offset(m0, __m128i *,
-                              sizeof(struct rte_ether_hdr) +
-                                  offsetof(struct rte_ipv4_hdr, time_to_live)));
+static void release_nat_port(struct worker_parameter *worker, struct smto_flow_key *flow_key) {
+#ifdef ENDPOINT_DEPENDENT_NAT
+  /// The port is free again for the peer once the in-direction key is removed
+  RTE_SET_USED(worker);
+  RTE_SET_USED(flow_key);
+#else
+  if (flow_key->tunnel_type != SMTO_TUNNEL_NONE) {
+    return;
+  }
+  if (flow_key->is_ipv6) {
+    free_nat_port(&worker->port_allocators[smto_cb->snat_ip_quantity], rte_be_to_cpu_16(flow_key->modify_tuple6.port1));
+  } else {
+    free_nat_port(&worker->port_allocators[flow_key->snat_index], rte_be_to_cpu_16(flow_key->modify_tuple.port1));
+  }
+#endif
+}
 
-  key->xmm = _mm_and_si128(tmpdata0, mask0);
-  key->tuple.proto = key->proto; /// Convert memory structure
+/**
+ * Pick an address of the SNAT pool for a new ipv4 flow and get a NAT port of it. The address is chosen by the hash of
+ * the flow so that the flows spread over the pool, and the next ones are probed when its ports run out.
+ *
+ * With ENDPOINT_DEPENDENT_NAT, a port is shared by the flows towards different peers, and it is probed in the flow
+ * table instead of taken from the allocator.
+ *
+ * @param worker The worker which creates the flow.
+ * @param flow_hash_map The flow table to add the flow into.
+ * @param tuple The tuple of the flow.
+ * @param sig The hash signature of the flow.
+ * @param snat_index Return the index of the address in the SNAT pool.
+ *
+ * @return The NAT port in host order, or 0 if all the addresses have run out of ports.
+ */
+static uint16_t alloc_snat_port(struct worker_parameter *worker,
+                                struct rte_hash *flow_hash_map,
+                                const struct rdarm_five_tuple *tuple,
+                                hash_sig_t sig,
+                                uint16_t *snat_index) {
+  uint16_t quantity = smto_cb->snat_ip_quantity;
+  uint16_t index = (uint16_t) (((uint64_t) sig * quantity) >> 32);
+#ifdef ENDPOINT_DEPENDENT_NAT
+  struct rdarm_five_tuple reply = *tuple;
+  reply.ip1 = tuple->ip2;
+  reply.port1 = tuple->port2;
+#else
+  RTE_SET_USED(flow_hash_map);
+  RTE_SET_USED(tuple);
+#endif
+  for (uint16_t i = 0; i < quantity; i++) {
+#ifdef ENDPOINT_DEPENDENT_NAT
+    reply.ip2 = rte_cpu_to_be_32(smto_cb->snat_ips[index]);
+    uint16_t nat_port = probe_nat_port(flow_hash_map, &reply, &reply.port2,
+                                       worker->nat_port_first, worker->nat_port_last, sig);
+#else
+    uint16_t nat_port = alloc_nat_port(&worker->port_allocators[index]);
+#endif
+    if (likely(nat_port != 0)) {
+      *snat_index = index;
+      return nat_port;
+    }
+    index = index + 1 == quantity ? 0 : index + 1;
+  }
+  return 0;
 }
 
-static __rte_always_inline int packet_processing(struct rte_mbuf *pkt_mbuf, uint16_t queue_index, uint16_t port_id) {
+/**
+ * Get a NAT port of SRC_IP6 for a new ipv6 flow, in the same way as alloc_snat_port().
+ *
+ * @return The NAT port in host order, or 0 if the ports have run out.
+ */
+static uint16_t alloc_snat6_port(struct worker_parameter *worker,
+                                 struct rte_hash *flow_hash_map,
+                                 const struct smto_ipv6_tuple *tuple,
+                                 hash_sig_t sig) {
+#ifdef ENDPOINT_DEPENDENT_NAT
+  struct smto_ipv6_tuple reply = *tuple;
+  rte_memcpy(reply.ip1, tuple->ip2, sizeof(tuple->ip2));
+  reply.port1 = tuple->port2;
+  rte_memcpy(reply.ip2, SRC_IP6, sizeof(SRC_IP6));
+  return probe_nat_port(flow_hash_map, &reply, &reply.port2, worker->nat_port_first, worker->nat_port_last, sig);
+#else
+  RTE_SET_USED(flow_hash_map);
+  RTE_SET_USED(tuple);
+  RTE_SET_USED(sig);
+  return alloc_nat_port(&worker->port_allocators[smto_cb->snat_ip_quantity]);
+#endif
+}
+
+/**
+ * Create the flow keys of both directions for a flow that has not appeared, and add them into the flow table.
+ *
+ * @param worker The worker which owns the flow.
+ * @param flow_hash_map The flow table of the ip version.
+ * @param pkt_mbuf The first packet of this flow.
+ * @param tuple The 5-tuple extracted from the packet.
+ * @param sig The hash signature of the 5-tuple.
+ * @param pkt_info The readable string of the 5-tuple.
+ * @param is_ipv6 Whether it is an ipv6 flow.
+ * @return The out-direction flow key, NULL on error.
+ */
+static struct smto_flow_key *create_flow(struct worker_parameter *worker,
+                                         struct rte_hash *flow_hash_map,
+                                         struct rte_mbuf *pkt_mbuf,
+                                         struct smto_flow_key *tuple,
+                                         hash_sig_t sig,
+                                         char *pkt_info,
+                                         bool is_ipv6) {
   int ret = 0;
-  struct smto_flow_key tuple = {0};
-//  zlog_debug(smto_cb->logger, "flow_key: %u", pkt_mbuf->packet_type);
-  if (pkt_mbuf->packet_type & RTE_PTYPE_L3_IPV4 && (pkt_mbuf->packet_type & (RTE_PTYPE_L4_UDP | RTE_PTYPE_L4_TCP))) {
-    get_ipv4_5tuple(pkt_mbuf, ipv4_mask.x, &tuple);
 
-    char pkt_info[MAX_PKT_INFO_LENGTH];
+  /// Allocate the flow keys of both directions at once
+  struct smto_flow_key_pair *flow_key_pair = NULL;
+  if (unlikely(rte_mempool_get(smto_cb->flow_key_pool, (void **) &flow_key_pair) != 0)) {
+    zlog_error(smto_cb->logger, "no free flow key for pkt(%s)", pkt_info);
+    return NULL;
+  }
+  memset(flow_key_pair, 0, sizeof(struct smto_flow_key_pair));
+
+  // Out-direction flow
+  struct smto_flow_key *flow_key = &flow_key_pair->out;
+  struct smto_flow_key *symmetrical_flow_key = &flow_key_pair->in;
+
+  flow_key->is_ipv6 = is_ipv6;
+  flow_key->tunnel_type = tuple->tunnel_type;
+  flow_key->vlan_depth = tuple->vlan_depth;
+  flow_key->create_at = rte_rdtsc();
+  flow_key->worker_id = worker->worker_id;
+  add_flow_counter(&flow_key->sw_counter, 1, pkt_mbuf->pkt_len);
+
+  if (flow_key->tunnel_type != SMTO_TUNNEL_NONE) {
+    /// The inner flow of a tunnel is forwarded without translation, so both directions keep their tuples
+    flow_key->tuple = tuple->tuple;
+    init_nat_template(&flow_key->modify_tuple, &flow_key->tuple);
+  } else {
+    /// Get a new port to modify the src ip and port
+    uint16_t nat_port = is_ipv6 ? alloc_snat6_port(worker, flow_hash_map, &tuple->tuple6, sig)
+                                : alloc_snat_port(worker, flow_hash_map, &tuple->tuple, sig, &flow_key->snat_index);
+    if (unlikely(nat_port == 0)) {
+      zlog_error(smto_cb->logger, "no free nat port for pkt(%s)", pkt_info);
+      rte_mempool_put(smto_cb->flow_key_pool, flow_key_pair);
+      return NULL;
+    }
+    if (is_ipv6) {
+      flow_key->tuple6 = tuple->tuple6;
+      init_nat6_template(&flow_key->modify_tuple6, &flow_key->tuple6);
+      rte_memcpy(flow_key->modify_tuple6.ip1, SRC_IP6, sizeof(SRC_IP6));
+      flow_key->modify_tuple6.port1 = rte_cpu_to_be_16(nat_port);
+      get_nat6_cksum_delta(&flow_key->tuple6, &flow_key->modify_tuple6);
+    } else {
+      flow_key->tuple = tuple->tuple;
+      init_nat_template(&flow_key->modify_tuple, &flow_key->tuple);
+      flow_key->modify_tuple.ip1 = rte_cpu_to_be_32(smto_cb->snat_ips[flow_key->snat_index]);
+      flow_key->modify_tuple.port1 = rte_cpu_to_be_16(nat_port);
+      get_nat_cksum_delta(&flow_key->tuple, &flow_key->modify_tuple);
+    }
+  }
+  ret = rte_hash_add_key_with_hash_data(flow_hash_map, get_tuple(flow_key, is_ipv6), sig, flow_key);
+  if (ret != 0) {
+    zlog_error(smto_cb->logger, "cannot add pkt(%s) into flow table: %s", pkt_info, rte_strerror(ret));
+    release_nat_port(worker, flow_key);
+    rte_mempool_put(smto_cb->flow_key_pool, flow_key_pair);
+    return NULL;
+  } else {
+    zlog_debug(smto_cb->logger, "success add a flow(%s) to flow hash table", pkt_info);
+  }
+
+  /// In-direction flow
+  if (flow_key->tunnel_type != SMTO_TUNNEL_NONE) {
+    /// Keep the VNI in the prefix
+    symmetrical_flow_key->tuple = flow_key->tuple;
+    symmetrical_flow_key->tuple.ip1 = flow_key->tuple.ip2;
+    symmetrical_flow_key->tuple.port1 = flow_key->tuple.port2;
+    symmetrical_flow_key->tuple.ip2 = flow_key->tuple.ip1;
+    symmetrical_flow_key->tuple.port2 = flow_key->tuple.port1;
+    init_nat_template(&symmetrical_flow_key->modify_tuple, &symmetrical_flow_key->tuple);
+  } else if (is_ipv6) {
+    symmetrical_flow_key->tuple6 = flow_key->tuple6;
+    rte_memcpy(symmetrical_flow_key->tuple6.ip1, flow_key->tuple6.ip2, sizeof(flow_key->tuple6.ip2));
+    symmetrical_flow_key->tuple6.port1 = flow_key->tuple6.port2;
+    rte_memcpy(symmetrical_flow_key->tuple6.ip2, flow_key->modify_tuple6.ip1, sizeof(flow_key->modify_tuple6.ip1));
+    symmetrical_flow_key->tuple6.port2 = flow_key->modify_tuple6.port1;
+
+    init_nat6_template(&symmetrical_flow_key->modify_tuple6, &symmetrical_flow_key->tuple6);
+    rte_memcpy(symmetrical_flow_key->modify_tuple6.ip2, flow_key->tuple6.ip1, sizeof(flow_key->tuple6.ip1));
+    symmetrical_flow_key->modify_tuple6.port2 = flow_key->tuple6.port1;
+    get_nat6_cksum_delta(&symmetrical_flow_key->tuple6, &symmetrical_flow_key->modify_tuple6);
+  } else {
+    symmetrical_flow_key->tuple = flow_key->tuple;
+    symmetrical_flow_key->tuple.ip1 = flow_key->tuple.ip2;
+    symmetrical_flow_key->tuple.port1 = flow_key->tuple.port2;
+    symmetrical_flow_key->tuple.ip2 = flow_key->modify_tuple.ip1;
+    symmetrical_flow_key->tuple.port2 = flow_key->modify_tuple.port1;
+
+    init_nat_template(&symmetrical_flow_key->modify_tuple, &symmetrical_flow_key->tuple);
+    symmetrical_flow_key->modify_tuple.ip2 = flow_key->tuple.ip1;
+    symmetrical_flow_key->modify_tuple.port2 = flow_key->tuple.port1;
+    get_nat_cksum_delta(&symmetrical_flow_key->tuple, &symmetrical_flow_key->modify_tuple);
+  }
+  symmetrical_flow_key->is_ipv6 = is_ipv6;
+  symmetrical_flow_key->tunnel_type = flow_key->tunnel_type;
+  symmetrical_flow_key->vlan_depth = flow_key->vlan_depth;
+  symmetrical_flow_key->symmetrical_flow_key = flow_key;
+  symmetrical_flow_key->worker_id = worker->worker_id;
+
+  ret = rte_hash_add_key_data(flow_hash_map, get_tuple(symmetrical_flow_key, is_ipv6), symmetrical_flow_key);
+  if (ret != 0) {
+    zlog_error(smto_cb->logger, "cannot add pkt(%s) into flow table: %s", pkt_info, rte_strerror(ret));
+    /// Roll back the out-direction flow, the pair is returned to the pool by the table after the grace period
+    rte_hash_del_key_with_hash(flow_hash_map, get_tuple(flow_key, is_ipv6), sig);
+    release_nat_port(worker, flow_key);
+    return NULL;
+  } else {
+    /// Only linked once the in-direction key is added, which tells the table when to return the pair
+    flow_key->symmetrical_flow_key = symmetrical_flow_key;
+    zlog_debug(smto_cb->logger, "success add symmetrical flow(%s) to flow hash table", pkt_info);
+  }
+  flow_key->last_seen = symmetrical_flow_key->last_seen = worker->aging_wheel.now;
+  aging_wheel_add(&worker->aging_wheel, flow_key, worker->aging_wheel.now + AGING_TIMEOUT_TICKS);
+  return flow_key;
+}
+
+/**
+ * The offload policy, decide whether a flow already in the flow table should be offloaded with this packet.
+ *
+ * By default, a flow is offloaded once it has offload_threshold packets, which starts from PKT_AMOUNT_TO_OFFLOAD and
+ * is adjusted by the flow engine. With HEAVY_HITTER_OFFLOAD, the packets and bytes are counted in the recent window
+ * instead, and the flow has to be a heavy hitter, so the short-lived flows do not take the rules of the NIC.
+ *
+ * A TCP connection is only offloaded after both directions have acknowledged, so the scans and the half-open
+ * connections never take a rule, and not after it starts to close.
+ *
+ * @param worker The worker which processes the packet.
+ * @param flow_key The flow of the packet, whose counter has counted the packet.
+ * @param sig The hash signature of the flow.
+ * @param pkt_len The length of the packet.
+ * @param is_tcp Whether the flow is a TCP connection which is tracked.
+ *
+ * @return Whether the flow is a candidate to offload.
+ */
+static __rte_always_inline bool is_offload_candidate(struct worker_parameter *worker,
+                                                     const struct smto_flow_key *flow_key,
+                                                     hash_sig_t sig,
+                                                     uint32_t pkt_len,
+                                                     bool is_tcp) {
+  if (is_tcp) {
+    uint8_t peer_seen = __atomic_load_n(&flow_key->symmetrical_flow_key->tcp_flags, __ATOMIC_RELAXED);
+    if (!(flow_key->tcp_flags & peer_seen & RTE_TCP_ACK_FLAG)
+        || ((flow_key->tcp_flags | peer_seen) & (RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG))) {
+      return false;
+    }
+  }
+#ifdef HEAVY_HITTER_OFFLOAD
+  uint32_t packets;
+  uint32_t bytes = heavy_hitter_update(&worker->heavy_hitter, sig, pkt_len, &packets);
+  RTE_SET_USED(flow_key);
+  /// Count by the window rather than the lifetime of the flow, a flow which has been quiet for a while is not offloaded
+  return PKT_AMOUNT_TO_OFFLOAD != -1 && packets >= smto_cb->offload_threshold
+      && bytes >= worker->heavy_hitter.bytes_threshold;
+#else
+  RTE_SET_USED(worker);
+  RTE_SET_USED(sig);
+  RTE_SET_USED(pkt_len);
+  return PKT_AMOUNT_TO_OFFLOAD != -1 && flow_key->sw_counter.packets >= smto_cb->offload_threshold;
+#endif
+}
+
+/**
+ * Request the flow engine to close a TCP connection, each stage is only requested once for a connection. The flow
+ * state is only removed after the rte_flows, so no stage is requested after TCP_CLOSE_STATE.
+ *
+ * @param worker The worker which processes the packet.
+ * @param flow_key The out-direction flow key of the connection.
+ * @param stage The enum smto_tcp_close stage.
+ */
+static void request_tcp_close(struct worker_parameter *worker, struct smto_flow_key *flow_key, uint8_t stage) {
+  uint8_t requested = __atomic_load_n(&flow_key->tcp_close, __ATOMIC_RELAXED);
+  do {
+    if (requested & (stage | TCP_CLOSE_STATE)) {
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&flow_key->tcp_close, &requested, requested | stage, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  /// Handed to the flow engine after the burst, as the packets in the burst still use the flow key
+  worker->closing_flows[worker->nb_closing_flows++] = (void *) ((uintptr_t) flow_key | stage);
+}
+
+/**
+ * Track the TCP flags of a connection, and close it on RST, or on the last ACK after both directions have sent FIN.
+ * The rte_flows are destroyed on the second FIN, while the flow state is kept for the last ACK.
+ *
+ * @param worker The worker which processes the packet.
+ * @param pkt_mbuf The packet, whose l2_len and l3_len have been set by the parser.
+ * @param flow_key The flow key of the packet.
+ */
+static __rte_always_inline void track_tcp_state(struct worker_parameter *worker,
+                                                struct rte_mbuf *pkt_mbuf,
+                                                struct smto_flow_key *flow_key) {
+  const struct rte_tcp_hdr *tcp_hdr = rte_pktmbuf_mtod_offset(pkt_mbuf, const struct rte_tcp_hdr *,
+                                                              pkt_mbuf->l2_len + pkt_mbuf->l3_len);
+  uint8_t flags = tcp_hdr->tcp_flags;
+  uint8_t seen = flow_key->tcp_flags | flags;
+  if (seen != flow_key->tcp_flags) {
+    __atomic_store_n(&flow_key->tcp_flags, seen, __ATOMIC_RELAXED);
+  }
+  if (likely(!(seen & (RTE_TCP_FIN_FLAG | RTE_TCP_RST_FLAG)))) {
+    return;
+  }
+  struct smto_flow_key *out_flow_key = &get_flow_key_pair(flow_key)->out;
+  uint8_t peer_seen = __atomic_load_n(&flow_key->symmetrical_flow_key->tcp_flags, __ATOMIC_RELAXED);
+  if (flags & RTE_TCP_RST_FLAG) {
+    request_tcp_close(worker, out_flow_key, TCP_CLOSE_STATE);
+  } else if (seen & peer_seen & RTE_TCP_FIN_FLAG) {
+    request_tcp_close(worker, out_flow_key, (flags & RTE_TCP_FIN_FLAG) ? TCP_CLOSE_RULES : TCP_CLOSE_STATE);
+  }
+}
+
+/**
+ * Update the flow state of a classified packet, the packet header is rewritten later with its protocol group.
+ *
+ * @param worker The worker which receives the packet.
+ * @param flow_hash_map The flow table of the ip version.
+ * @param pkt_mbuf The packet.
+ * @param tuple The 5-tuple extracted from the packet.
+ * @param sig The hash signature of the 5-tuple.
+ * @param flow_key_ptr The result of bulk lookup, NULL means the flow is missed in the flow table. It is set to the
+ *                     flow key of the packet on success, and NULL on error.
+ * @param is_ipv6 Whether it is an ipv6 packet, always a constant.
+ * @return SMTO_SUCCESS on success, other on error.
+ */
+static __rte_always_inline int packet_processing(struct worker_parameter *worker,
+                                                 struct rte_hash *flow_hash_map,
+                                                 struct rte_mbuf *pkt_mbuf,
+                                                 struct smto_flow_key *tuple,
+                                                 hash_sig_t sig,
+                                                 struct smto_flow_key **flow_key_ptr,
+                                                 const bool is_ipv6) {
+  int ret = 0;
+  struct smto_flow_key *flow_key = *flow_key_ptr;
+  *flow_key_ptr = NULL;
+
+  char pkt_info[MAX_PKT_INFO_LENGTH];
 #ifndef RELEASE
-    dump_pkt_info(&tuple.tuple, port_id, queue_index, pkt_info, MAX_PKT_INFO_LENGTH);
+  if (is_ipv6) {
+    dump_ipv6_pkt_info(&tuple->tuple6, worker->port_id, worker->queue_id, pkt_info, MAX_PKT_INFO_LENGTH);
+  } else {
+    dump_pkt_info(&tuple->tuple, worker->port_id, worker->queue_id, pkt_info, MAX_PKT_INFO_LENGTH);
+  }
 #endif
-    struct smto_flow_key *flow_key = 0;
-    ret = rte_hash_lookup_data(smto_cb->flow_hash_map, &tuple.tuple, (void **) &flow_key);
-
-    if (ret == -ENOENT) { ///< A flow that has not appeared
-      // Out-direction flow
-      flow_key = rte_zmalloc("flow_key", sizeof(struct smto_flow_key), 0);
-      struct smto_flow_key *symmetrical_flow_key = rte_zmalloc("flow_key", sizeof(struct smto_flow_key), 0);
-
-      rte_memcpy(&flow_key->tuple, &tuple, sizeof(tuple));
-      flow_key->create_at = rte_rdtsc();
-      flow_key->packet_amount++;
-      flow_key->flow_size += pkt_mbuf->pkt_len;
-
-      /// Get a new port to modify the src ip and port
-      void *port_object = 0;
-      rte_ring_dequeue(smto_cb->port_pool, &port_object);
-      flow_key->modify_tuple = flow_key->tuple;
-      flow_key->modify_tuple.ip1 = rte_cpu_to_be_32(SRC_IP);
-      flow_key->modify_tuple.port1 = rte_cpu_to_be_16((uint16_t) (uintptr_t) port_object);
-      ret = rte_hash_add_key_data(smto_cb->flow_hash_map, &flow_key->tuple, flow_key);
-      if (ret != 0) {
-        zlog_error(smto_cb->logger, "cannot add pkt(%s) into flow table: %s", pkt_info, rte_strerror(ret));
-        return SMTO_ERROR_HASH_MAP_OPERATION;
-      } else {
-        zlog_debug(smto_cb->logger, "success add a flow(%s) to flow hash table", pkt_info);
-      }
+  if (flow_key == NULL) {
+    /// The flow may be created by a previous packet in the same burst after the bulk lookup
+    ret = rte_hash_lookup_with_hash_data(flow_hash_map, get_tuple(tuple, is_ipv6), sig, (void **) &flow_key);
+  }
 
-      /// In-direction flow
-      symmetrical_flow_key->tuple = flow_key->tuple;
-      symmetrical_flow_key->tuple.ip1 = flow_key->tuple.ip2;
-      symmetrical_flow_key->tuple.port1 = flow_key->tuple.port2;
-      symmetrical_flow_key->tuple.ip2 = flow_key->modify_tuple.ip1;
-      symmetrical_flow_key->tuple.port2 = flow_key->modify_tuple.port1;
-      symmetrical_flow_key->symmetrical_flow_key = flow_key;
-
-      symmetrical_flow_key->modify_tuple = symmetrical_flow_key->tuple;
-      symmetrical_flow_key->modify_tuple.ip2 = flow_key->tuple.ip1;
-      symmetrical_flow_key->modify_tuple.port2 = flow_key->tuple.port1;
-
-      ret = rte_hash_add_key_data(smto_cb->flow_hash_map, &symmetrical_flow_key->tuple, symmetrical_flow_key);
-      flow_key->symmetrical_flow_key = symmetrical_flow_key;
-      if (ret != 0) {
-        zlog_error(smto_cb->logger, "cannot add pkt(%s) into flow table: %s", pkt_info, rte_strerror(ret));
-        return SMTO_ERROR_HASH_MAP_OPERATION;
-      } else {
-        zlog_debug(smto_cb->logger, "success add symmetrical flow(%s) to flow hash table", pkt_info);
-      }
+  /// The TCP connections carried by tunnels are not tracked, as their rte_flows do not match the flags
+  bool is_tcp = tuple->tunnel_type == SMTO_TUNNEL_NONE
+      && (is_ipv6 ? tuple->tuple6.proto : tuple->tuple.proto) == IPPROTO_TCP;
+  if (ret == -ENOENT) { ///< A flow that has not appeared
+    flow_key = create_flow(worker, flow_hash_map, pkt_mbuf, tuple, sig, pkt_info, is_ipv6);
+    if (flow_key == NULL) {
+      return SMTO_ERROR_HASH_MAP_OPERATION;
+    }
+    *flow_key_ptr = flow_key;
+    if (is_tcp) {
+      track_tcp_state(worker, pkt_mbuf, flow_key);
+    }
+  } else if (ret >= 0) {
+    *flow_key_ptr = flow_key;
+    add_flow_counter(&flow_key->sw_counter, 1, pkt_mbuf->pkt_len);
+    /// In the same cache line as the counter, so refreshing it costs no extra miss
+    flow_key->last_seen = worker->aging_wheel.now;
+    if (flow_key->sw_counter.packets % 50000 == 1) {
+      zlog_debug(smto_cb->logger,
+                 "capture a packet which belong to a flow in flow table, which already have %lu packets and total size is %lu",
+                 flow_key->sw_counter.packets,
+                 flow_key->sw_counter.bytes);
+    }
+    if (is_tcp) {
+      track_tcp_state(worker, pkt_mbuf, flow_key);
+    }
+    /* Assume the flow can be offloaded now */
+    enum offload_status not_offload = NOT_OFFLOAD;
+    if (is_offload_candidate(worker, flow_key, sig, pkt_mbuf->pkt_len, is_tcp)
+        && __atomic_load_n(&flow_key->is_offload, __ATOMIC_RELAXED) == NOT_OFFLOAD
+        && __atomic_compare_exchange_n(&flow_key->is_offload, &not_offload, OFFLOADING, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      /// Decouple the packet processing and offloading, the candidates are handed over at the end of the burst
+      worker->offload_candidates[worker->nb_offload_candidates++] = flow_key;
+      zlog_debug(smto_cb->logger, "collect a flow(%s) to offload", pkt_info);
+    }
+  } else {
+    zlog_error(smto_cb->logger, "cannot find pkt(%s) in flow table: %s", pkt_info, rte_strerror(ret));
+    return SMTO_ERROR_HASH_MAP_OPERATION;
+  }
+  return SMTO_SUCCESS;
+}
+
+/**
+ * Rewrite the addresses and ports of a packet to the modify tuple of its flow, and update or offload the checksums.
+ * Always called with a constant protocol and ip version, so each variant is compiled separately.
+ *
+ * @param pkt_mbuf The packet, whose l2_len and l3_len have been set by the parser.
+ * @param flow_key The flow key of the packet.
+ * @param proto IPPROTO_TCP or IPPROTO_UDP.
+ * @param is_ipv6 Whether it is an ipv6 packet.
+ * @param cksums The checksums to update by software in this burst, NULL if the port can offload them.
+ */
+static __rte_always_inline void nat_rewrite(struct rte_mbuf *pkt_mbuf,
+                                            struct smto_flow_key *flow_key,
+                                            const uint8_t proto,
+                                            const bool is_ipv6,
+                                            struct cksum_burst *cksums) {
+  void *l3_hdr = rte_pktmbuf_mtod_offset(pkt_mbuf, void *, pkt_mbuf->l2_len);
+  struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *) l3_hdr;
+  struct rte_ipv6_hdr *ipv6_hdr = (struct rte_ipv6_hdr *) l3_hdr;
+  /// The ports are at the same offset of tcp and udp header
+  struct rte_udp_hdr *l4_hdr = (struct rte_udp_hdr *) ((char *) l3_hdr + pkt_mbuf->l3_len);
+  /// The whole ipv4 template is loaded by one 16-byte read
+  struct smto_nat_template nat = {.xmm = _mm_load_si128(&flow_key->modify_tuple.xmm)};
+  uint16_t l4_cksum_delta;
+  if (is_ipv6) {
+    rte_memcpy(ipv6_hdr->src_addr, flow_key->modify_tuple6.ip1, sizeof(ipv6_hdr->src_addr));
+    rte_memcpy(ipv6_hdr->dst_addr, flow_key->modify_tuple6.ip2, sizeof(ipv6_hdr->dst_addr));
+    l4_hdr->src_port = flow_key->modify_tuple6.port1;
+    l4_hdr->dst_port = flow_key->modify_tuple6.port2;
+    l4_cksum_delta = flow_key->modify_tuple6.l4_cksum_delta;
+  } else {
+    ipv4_hdr->src_addr = nat.ip1;
+    ipv4_hdr->dst_addr = nat.ip2;
+    l4_hdr->src_port = nat.port1;
+    l4_hdr->dst_port = nat.port2;
+    l4_cksum_delta = nat.l4_cksum_delta;
+  }
 
-    } else if (ret >= 0) {
-      flow_key->packet_amount++;
-      flow_key->flow_size += pkt_mbuf->pkt_len;
-      if (flow_key->packet_amount % 50000 == 1) {
-        zlog_debug(smto_cb->logger,
-                   "capture a packet which belong to a flow in flow table, which already have %u packets and total size is %u",
-                   flow_key->packet_amount,
-                   flow_key->flow_size);
+  /// A zero udp checksum means no checksum, which should be kept
+  cksum_field_t *l4_cksum = proto == IPPROTO_TCP ? &((struct rte_tcp_hdr *) l4_hdr)->cksum : &l4_hdr->dgram_cksum;
+  bool has_l4_cksum = proto == IPPROTO_TCP || *l4_cksum != 0;
+
+  if (cksums != NULL) {
+    if (!is_ipv6) {
+      cksum_burst_add(cksums, &ipv4_hdr->hdr_checksum, nat.ipv4_cksum_delta, false);
+    }
+    if (has_l4_cksum) {
+      cksum_burst_add(cksums, l4_cksum, l4_cksum_delta, proto == IPPROTO_UDP);
+    }
+    return;
+  }
+
+  if (is_ipv6) {
+    pkt_mbuf->ol_flags = RTE_MBUF_F_TX_IPV6;
+  } else {
+    pkt_mbuf->ol_flags = RTE_MBUF_F_TX_IPV4 | RTE_MBUF_F_TX_IP_CKSUM;
+    ipv4_hdr->hdr_checksum = 0;
+  }
+  if (proto == IPPROTO_TCP) {
+    pkt_mbuf->l4_len = (((struct rte_tcp_hdr *) l4_hdr)->data_off & 0xf0) >> 2;
+    pkt_mbuf->ol_flags |= RTE_MBUF_F_TX_TCP_CKSUM;
+  } else {
+    pkt_mbuf->l4_len = sizeof(struct rte_udp_hdr);
+    if (has_l4_cksum) {
+      pkt_mbuf->ol_flags |= RTE_MBUF_F_TX_UDP_CKSUM;
+    }
+  }
+  /// The device expects the pseudo header checksum in the l4 checksum field
+  if (has_l4_cksum) {
+    *l4_cksum = is_ipv6 ? rte_ipv6_phdr_cksum(ipv6_hdr, pkt_mbuf->ol_flags)
+                        : rte_ipv4_phdr_cksum(ipv4_hdr, pkt_mbuf->ol_flags);
+  }
+}
+
+/**
+ * Rewrite a group of packets with the same protocol and ip version.
+ *
+ * @param pkt_mbufs The packets.
+ * @param flow_keys The flow key of each packet.
+ * @param nb_pkts The quantity of packets.
+ * @param proto IPPROTO_TCP or IPPROTO_UDP.
+ * @param is_ipv6 Whether they are ipv6 packets.
+ * @param cksums The checksums to update by software in this burst, NULL if the port can offload them.
+ */
+static __rte_always_inline void nat_rewrite_group(struct rte_mbuf **pkt_mbufs,
+                                                  struct smto_flow_key **flow_keys,
+                                                  uint16_t nb_pkts,
+                                                  const uint8_t proto,
+                                                  const bool is_ipv6,
+                                                  struct cksum_burst *cksums) {
+  for (uint16_t i = 0; i < nb_pkts; i++) {
+    nat_rewrite(pkt_mbufs[i], flow_keys[i], proto, is_ipv6, cksums);
+  }
+}
+
+/**
+ * Classify the tuples of one ip version extracted from a burst, update the flows and rewrite the packets.
+ * Always called with a constant ip version, so the ipv4 and ipv6 variants are compiled separately.
+ *
+ * @param worker The worker which receives the packets.
+ * @param flow_hash_map The flow table of the ip version.
+ * @param mbufs The packets of the burst.
+ * @param tuples The extracted tuples.
+ * @param pkt_indexes The index of mbuf which each tuple belongs to.
+ * @param nb_tuple The quantity of tuples.
+ * @param is_ipv6 Whether the tuples are ipv6 ones.
+ * @param cksums The checksums to update by software in this burst, NULL if the port can offload them.
+ */
+static __rte_always_inline void process_tuples(struct worker_parameter *worker,
+                                               struct rte_hash *flow_hash_map,
+                                               struct rte_mbuf **mbufs,
+                                               struct smto_flow_key *tuples,
+                                               const uint16_t *pkt_indexes,
+                                               uint16_t nb_tuple,
+                                               const bool is_ipv6,
+                                               struct cksum_burst *cksums) {
+  const void *tuple_ptrs[MAX_BULK_SIZE]; ///< The keys used to do bulk lookup.
+  hash_sig_t sigs[MAX_BULK_SIZE]; ///< The hash signatures of the keys.
+  struct smto_flow_key *flow_keys[MAX_BULK_SIZE]; ///< The result of bulk lookup.
+  struct rte_mbuf *tcp_mbufs[MAX_BULK_SIZE], *udp_mbufs[MAX_BULK_SIZE]; ///< The classified packets of each protocol.
+  struct smto_flow_key *tcp_flow_keys[MAX_BULK_SIZE], *udp_flow_keys[MAX_BULK_SIZE];
+  uint16_t nb_tcp = 0, nb_udp = 0;
+  uint64_t hit_mask = 0;
+
+  for (uint16_t i = 0; i < nb_tuple; i++) {
+    tuple_ptrs[i] = get_tuple(&tuples[i], is_ipv6);
+    sigs[i] = rte_hash_hash(flow_hash_map, tuple_ptrs[i]);
+  }
+
+  /// Stage 2: classify the whole burst by one lookup, which prefetches all the buckets before comparing keys
+  if (rte_hash_lookup_with_hash_bulk_data(flow_hash_map,
+                                          tuple_ptrs,
+                                          sigs,
+                                          nb_tuple,
+                                          &hit_mask,
+                                          (void **) flow_keys) < 0) {
+    zlog_error(smto_cb->logger, "failed to lookup a burst of %u packets in flow table", nb_tuple);
+  }
+  for (uint16_t i = 0; i < nb_tuple; i++) {
+    if (!(hit_mask & (1ULL << i))) {
+      flow_keys[i] = NULL;
+    }
+  }
+
+  /// Stage 3: prefetch the flow states PREFETCH_OFFSET flows ahead, then update the flows
+  for (uint16_t i = 0; i < PREFETCH_OFFSET && i < nb_tuple; i++) {
+    if (flow_keys[i] != NULL) {
+      rte_prefetch0(flow_keys[i]);
+    }
+  }
+  for (uint16_t i = 0; i < nb_tuple; i++) {
+    if (i + PREFETCH_OFFSET < nb_tuple && flow_keys[i + PREFETCH_OFFSET] != NULL) {
+      rte_prefetch0(flow_keys[i + PREFETCH_OFFSET]);
+    }
+    packet_processing(worker, flow_hash_map, mbufs[pkt_indexes[i]], &tuples[i], sigs[i], &flow_keys[i], is_ipv6);
+  }
+
+  /// Stage 4: group the classified packets by protocol without branch, then rewrite each group by its own variant
+  for (uint16_t i = 0; i < nb_tuple; i++) {
+    /// The tunneled packets are forwarded without rewriting
+    bool is_valid = flow_keys[i] != NULL && tuples[i].tunnel_type == SMTO_TUNNEL_NONE;
+    bool is_tcp = (is_ipv6 ? tuples[i].tuple6.proto : tuples[i].tuple.proto) == IPPROTO_TCP;
+    tcp_mbufs[nb_tcp] = udp_mbufs[nb_udp] = mbufs[pkt_indexes[i]];
+    tcp_flow_keys[nb_tcp] = udp_flow_keys[nb_udp] = flow_keys[i];
+    nb_tcp += is_valid & is_tcp;
+    nb_udp += is_valid & !is_tcp;
+  }
+  nat_rewrite_group(tcp_mbufs, tcp_flow_keys, nb_tcp, IPPROTO_TCP, is_ipv6, cksums);
+  nat_rewrite_group(udp_mbufs, udp_flow_keys, nb_udp, IPPROTO_UDP, is_ipv6, cksums);
+}
+
+/**
+ * Hand the flows to offload which are collected in a burst to the flow engine by one enqueue into the flow rules ring
+ * owned by this worker, so no cache line is shared with the other workers. The flows which do not fit in the ring are
+ * set back to NOT_OFFLOAD, they have never been seen by the flow engine and will be collected again by a later packet.
+ *
+ * @param worker The worker which collects the flows.
+ */
+static __rte_always_inline void flush_offload_candidates(struct worker_parameter *worker) {
+  uint16_t nb_candidates = worker->nb_offload_candidates;
+  if (likely(nb_candidates == 0)) {
+    return;
+  }
+  worker->nb_offload_candidates = 0;
+  unsigned int nb_enqueued = rte_ring_enqueue_burst(worker->flow_rules_ring,
+                                                    (void *const *) worker->offload_candidates,
+                                                    nb_candidates, NULL);
+  worker->offload_enqueued += nb_enqueued;
+  if (unlikely(nb_enqueued < nb_candidates)) {
+    for (uint16_t i = nb_enqueued; i < nb_candidates; i++) {
+      __atomic_store_n(&worker->offload_candidates[i]->is_offload, NOT_OFFLOAD, __ATOMIC_RELAXED);
+    }
+    worker->offload_deferred += nb_candidates - nb_enqueued;
+    zlog_debug(smto_cb->logger, "flow rules ring is full, %u flows are deferred", nb_candidates - nb_enqueued);
+  }
+}
+
+/**
+ * Hand the TCP connections to close which are collected in a burst to the flow engine. The stage which does not fit in
+ * the ring is withdrawn, so it is requested again by a later packet, or the flow is left to aging.
+ *
+ * @param worker The worker which collects the connections.
+ */
+static __rte_always_inline void flush_closing_flows(struct worker_parameter *worker) {
+  uint16_t nb_closing = worker->nb_closing_flows;
+  if (likely(nb_closing == 0)) {
+    return;
+  }
+  worker->nb_closing_flows = 0;
+  unsigned int nb_enqueued = rte_ring_enqueue_burst(worker->flow_rules_ring, worker->closing_flows, nb_closing, NULL);
+  for (uint16_t i = nb_enqueued; i < nb_closing; i++) {
+    uintptr_t tagged = (uintptr_t) worker->closing_flows[i];
+    struct smto_flow_key *flow_key = (struct smto_flow_key *) (tagged & ~FLOW_RULE_TAG_MASK);
+    __atomic_fetch_and(&flow_key->tcp_close, (uint8_t) ~(tagged & FLOW_RULE_TAG_MASK), __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Remove the closed TCP connections and the idle flows handed back by the flow engine, whose rte_flows have been
+ * destroyed and which can never be offloaded again, from the flow table. The other workers may still hold the flow
+ * keys, so they are returned to the pool by the table after all the workers have reported quiescent.
+ *
+ * @param worker The worker which creates the flows.
+ */
+static void remove_closed_flows(struct worker_parameter *worker) {
+  void *flow_keys[MAX_BULK_SIZE];
+  unsigned int nb_closed = rte_ring_dequeue_burst(worker->flow_teardown_ring, flow_keys, MAX_BULK_SIZE, NULL);
+  for (unsigned int i = 0; i < nb_closed; i++) {
+    struct smto_flow_key *flow_key = (struct smto_flow_key *) flow_keys[i];
+    aging_wheel_del(flow_key);
+    /// Counted as aged only if it is still idle, a packet may arrive after the aging requests the removal
+    if ((int32_t) (aging_last_seen(flow_key) + AGING_TIMEOUT_TICKS - worker->aging_wheel.now) <= 0) {
+      worker->flows_aged++;
+    } else {
+      worker->flows_closed++;
+    }
+    struct rte_hash *flow_hash_map = flow_key->is_ipv6 ? worker->flow6_hash_map : worker->flow_hash_map;
+    struct smto_flow_key *directions[2] = {flow_key, flow_key->symmetrical_flow_key};
+    /// The out-direction key is deleted first, so the pair is returned with the in-direction one
+    for (int j = 0; j < 2; j++) {
+      rte_hash_del_key(flow_hash_map, get_tuple(directions[j], flow_key->is_ipv6));
+    }
+    release_nat_port(worker, flow_key);
+  }
+}
+
+/**
+ * Check the flows in the due slots of the aging wheel, at most AGING_BATCH_SIZE of them, and remove the ones handled
+ * in software which have been idle in both directions for FLOW_TIMEOUT_SECOND. The flows with rte_flows are left to the
+ * rte_flow aging, and checked again after a timeout.
+ *
+ * The idle flows are removed in the same way as the closed TCP connections, through the flow engine which makes sure
+ * they are never offloaded again, then handed back to remove_closed_flows(). They stay in the wheel until then, and
+ * are requested again if the request is withdrawn as the flow rules ring is full.
+ *
+ * @param worker The worker which creates the flows.
+ */
+static void expire_idle_flows(struct worker_parameter *worker) {
+  struct smto_aging_wheel *wheel = &worker->aging_wheel;
+  uint16_t budget = AGING_BATCH_SIZE;
+  while ((int32_t) (wheel->now - wheel->next_tick) >= 0) {
+    struct smto_flow_key **head = &wheel->slots[wheel->next_tick & (AGING_WHEEL_SLOTS - 1)];
+    while (*head != NULL) {
+      if (budget-- == 0) {
+        /// Continue with the same slot in the next loop
+        flush_closing_flows(worker);
+        return;
       }
-      /* Assume the flow can be offloaded now */
-      if (PKT_AMOUNT_TO_OFFLOAD != -1 && flow_key->packet_amount >= PKT_AMOUNT_TO_OFFLOAD
-          && flow_key->is_offload == NOT_OFFLOAD) {
-        /// Decouple the packet processing and offloading
-//        uint64_t start_time = rte_rdtsc();
-        ret = rte_ring_enqueue(smto_cb->flow_rules_ring, flow_key);
-        if (ret != 0) {
-          zlog_error(smto_cb->logger, "cannot add flow(%s) into flow rules ring: %s", pkt_info, rte_strerror(ret));
-        } else {
-          zlog_debug(smto_cb->logger, "success add a flow(%s) to flow rules ring", pkt_info);
-          flow_key->is_offload = OFFLOADING;
-        }
-//        queue_used_times[used_times_index] = GET_NANOSECOND(start_time);
-
-        /// Offload the flow directly
-//        start_time = rte_rdtsc();
-//        struct rte_flow_error flow_error = {0};
-//        struct rte_flow *flow = create_general_offload_flow(port_id, flow_key, &flow_error);
-//        if (flow == NULL) {
-//          zlog_error(smto_cb->logger, "cannot create a offload flow of packet(%s): %s", pkt_info, flow_error.message);
-//          return SMTO_ERROR_FLOW_CREATE;
-//        }
-//        flow_key->is_offload = OFFLOAD_SUCCESS;
-//        flow_key->flow = flow;
-
-//        flow_used_times[used_times_index++] = GET_NANOSECOND(start_time);
-//        if (used_times_index % 10000 == 0) {
-//          zlog_info(smto_cb->logger, "create %u flows", used_times_index);
-//        }
-//        if (used_times_index >= TIME_COUNT) {
-//          zlog_category_t *logger = zlog_get_category("benchmark");
-//          for (int i = 0; i < TIME_COUNT; ++i) {
-//            zlog_info(logger, "%ld", queue_used_times[i]);
-//          }
-//          zlog_info(logger, "---------------------------------");
-//          for (int i = 0; i < TIME_COUNT; ++i) {
-//            zlog_info(logger, "%ld", flow_used_times[i]);
-//          }
-//          smto_cb->is_running = false;
-//          return SMTO_SUCCESS;
-//        }
+      struct smto_flow_key *flow_key = *head;
+      struct smto_flow_key *symmetrical_flow_key = flow_key->symmetrical_flow_key;
+      aging_wheel_del(flow_key);
 
+      uint32_t expire_tick = aging_last_seen(flow_key) + AGING_TIMEOUT_TICKS;
+      if ((int32_t) (expire_tick - wheel->next_tick) > 0) {
+        /// Seen since it is linked, or withdrawn and seen again
+        aging_wheel_add(wheel, flow_key, expire_tick);
+        continue;
       }
-    } else {
-      zlog_error(smto_cb->logger, "cannot find pkt(%s) in flow table: %s", pkt_info, rte_strerror(ret));
-      return SMTO_ERROR_HASH_MAP_OPERATION;
+      enum offload_status status = __atomic_load_n(&flow_key->is_offload, __ATOMIC_RELAXED);
+      enum offload_status symmetrical_status = __atomic_load_n(&symmetrical_flow_key->is_offload, __ATOMIC_RELAXED);
+      if (status == OFFLOADING || status == OFFLOAD_SUCCESS
+          || symmetrical_status == OFFLOADING || symmetrical_status == OFFLOAD_SUCCESS) {
+        aging_wheel_add(wheel, flow_key, wheel->next_tick + AGING_TIMEOUT_TICKS);
+        continue;
+      }
+      request_tcp_close(worker, flow_key, TCP_CLOSE_STATE);
+      /// Check again soon in case the request is withdrawn
+      aging_wheel_add(wheel, flow_key, wheel->next_tick + 1);
     }
+    wheel->next_tick++;
+  }
+  flush_closing_flows(worker);
+}
 
-    struct rte_ether_hdr *eth_hdr = rte_pktmbuf_mtod(pkt_mbuf, struct rte_ether_hdr *);
-    struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *) (eth_hdr + 1);
-    struct rte_tcp_hdr *tcp_hdr = (struct rte_tcp_hdr *) (ipv4_hdr + 1);
-    ipv4_hdr->src_addr = flow_key->modify_tuple.ip1;
-    tcp_hdr->src_port = flow_key->modify_tuple.port1;
-    ipv4_hdr->dst_addr = flow_key->modify_tuple.ip2;
-    tcp_hdr->dst_port = flow_key->modify_tuple.port2;
-    pkt_mbuf->l3_len = sizeof(struct rte_ipv4_hdr);
-    pkt_mbuf->l4_len = sizeof(struct rte_tcp_hdr);
-    pkt_mbuf->ol_flags = RTE_MBUF_F_TX_IP_CKSUM | RTE_MBUF_F_TX_TCP_CKSUM | RTE_MBUF_F_TX_UDP_CKSUM;
-    return SMTO_SUCCESS;
+#ifdef ADAPTIVE_POLL
+/**
+ * Back off from busy polling after a run of empty polls. Wait for the rx interrupt of the queue if the device supports
+ * it, which wakes the worker up as soon as a packet arrives, otherwise sleep for a few microseconds.
+ *
+ * @param worker The parameter of the packet worker.
+ */
+static void idle_wait(struct worker_parameter *worker) {
+  worker->idle_waits++;
+  /// Holds no flow key while waiting, so the grace periods do not wait for it
+  rte_rcu_qsbr_thread_offline(smto_cb->flow_table_rcu, worker->worker_id);
+  if (worker->rx_intr_enabled && rte_eth_dev_rx_intr_enable(worker->port_id, worker->queue_id) == 0) {
+    /// Packets may arrive before the interrupt is armed, so only wait if the queue is known to be empty
+    if (rte_eth_rx_queue_count(worker->port_id, worker->queue_id) == 0) {
+      struct rte_epoll_event event;
+      rte_epoll_wait(RTE_EPOLL_PER_THREAD, &event, 1, IDLE_INTR_TIMEOUT_MS);
+    }
+    rte_eth_dev_rx_intr_disable(worker->port_id, worker->queue_id);
   } else {
-    zlog_error(smto_cb->logger, "Packet type is not supported.");
-    return SMTO_ERROR_UNSUPPORTED_PACKET_TYPE;
+    rte_delay_us_sleep(IDLE_SLEEP_US);
   }
+  rte_rcu_qsbr_thread_online(smto_cb->flow_table_rcu, worker->worker_id);
+}
+#endif
+
+/**
+ * Called by the tx buffer with the packets rejected by the tx ring. Resend them a few times before dropping.
+ *
+ * @param unsent The packets not sent.
+ * @param count The amount of packets not sent.
+ * @param userdata The parameter of the packet worker.
+ */
+static void tx_retry(struct rte_mbuf **unsent, uint16_t count, void *userdata) {
+  struct worker_parameter *worker = (struct worker_parameter *) userdata;
+  uint16_t nb_tx = 0;
+  for (int retry = 0; retry < TX_RETRY_TIMES && nb_tx < count; retry++) {
+    worker->tx_retries++;
+    rte_pause();
+    nb_tx += rte_eth_tx_burst(worker->port_id, worker->queue_id, &unsent[nb_tx], count - nb_tx);
+  }
+  if (unlikely(nb_tx < count)) {
+    worker->tx_dropped += count - nb_tx;
+    rte_pktmbuf_free_bulk(&unsent[nb_tx], count - nb_tx);
+  }
+}
+
+double get_busy_ratio(const struct worker_parameter *worker) {
+  uint64_t busy_cycles = worker->busy_cycles;
+  uint64_t total_cycles = busy_cycles + worker->idle_cycles;
+  return total_cycles == 0 ? 0 : (double) busy_cycles / (double) total_cycles;
 }
 
 int process_loop(void *args) {
   unsigned lcore_id;
   lcore_id = rte_lcore_id();
-  uint16_t queue_id = ((struct worker_parameter *) args)->queue_id;
-  uint16_t port_id = ((struct worker_parameter *) args)->port_id;
+  struct worker_parameter *worker = (struct worker_parameter *) args;
+  uint16_t queue_id = worker->queue_id;
+  uint16_t port_id = worker->port_id;
+  struct rte_hash *flow_hash_map = worker->flow_hash_map;
+  struct rte_hash *flow6_hash_map = worker->flow6_hash_map;
   zlog_info(smto_cb->logger, "worker%u for port%u-queue%u start working!", lcore_id, port_id, queue_id);
+#ifdef ADAPTIVE_POLL
+  /// The queue count is needed to check the packets arriving before the interrupt is armed, e.g. -ENOTSUP otherwise
+  worker->rx_intr_enabled = rte_eth_rx_queue_count(port_id, queue_id) >= 0
+      && rte_eth_dev_rx_intr_ctl_q(port_id, queue_id, RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD, NULL) == 0;
+  if (!worker->rx_intr_enabled) {
+    zlog_warn(smto_cb->logger, "rx interrupt is not available on port%u-queue%u, sleep when idle", port_id, queue_id);
+  }
+  uint32_t idle_polls = 0;
+#endif
+
+  /// Buffer the packets to send, which is flushed when full or has been waiting for TX_DRAIN_US
+  struct rte_eth_dev_tx_buffer *tx_buffer = rte_zmalloc_socket("tx_buffer",
+                                                               RTE_ETH_TX_BUFFER_SIZE(TX_BUFFER_SIZE),
+                                                               0,
+                                                               rte_eth_dev_socket_id(port_id));
+  if (tx_buffer == NULL) {
+    zlog_error(smto_cb->logger, "cannot allocate tx buffer for port%u-queue%u", port_id, queue_id);
+    return SMTO_ERROR_MEMORY_ALLOCATION;
+  }
+  rte_eth_tx_buffer_init(tx_buffer, TX_BUFFER_SIZE);
+  rte_eth_tx_buffer_set_err_callback(tx_buffer, tx_retry, worker);
+  const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * TX_DRAIN_US;
+  uint64_t last_drain_tsc = rte_rdtsc();
+  const uint64_t aging_tick_tsc = (rte_get_tsc_hz() + MS_PER_S - 1) / MS_PER_S * AGING_TICK_MS;
+  uint64_t last_aging_tsc = last_drain_tsc;
+  RTE_BUILD_BUG_ON(AGING_TIMEOUT_TICKS >= AGING_WHEEL_SLOTS);
+#ifdef HEAVY_HITTER_OFFLOAD
+  const uint64_t hh_window_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * HH_WINDOW_US;
+  worker->heavy_hitter.window_start = last_drain_tsc;
+  worker->heavy_hitter.bytes_threshold = HH_BYTES_THRESHOLD;
+#endif
 
   /// Pre-allocate the local variable
   struct rte_mbuf *mbufs[MAX_BULK_SIZE] = {0};
+  struct smto_flow_key tuples[MAX_BULK_SIZE]; ///< The ipv4 5-tuples of the supported packets in a burst.
+  struct smto_flow_key tuples6[MAX_BULK_SIZE]; ///< The ipv6 5-tuples of the supported packets in a burst.
+  uint16_t pkt_indexes[MAX_BULK_SIZE]; ///< The index of mbuf which each ipv4 tuple belongs to.
+  uint16_t pkt_indexes6[MAX_BULK_SIZE]; ///< The index of mbuf which each ipv6 tuple belongs to.
   uint16_t nb_rx;
-  uint16_t nb_tx;
-  uint16_t packet_index;
+  uint16_t nb_tuple, nb_tuple6;
+  struct cksum_burst sw_cksums = {0};
+  struct cksum_burst *cksums = worker->sw_cksum ? &sw_cksums : NULL; ///< Only used when checksums are not offloaded.
+  uint64_t last_tsc = rte_rdtsc(), current_tsc;
+#ifdef WORKER_BENCHMARK
+  uint64_t benchmark_packets = 0;
+  double benchmark_time = 0;
+  zlog_category_t *benchmark_logger = zlog_get_category("benchmark");
+#endif
+
+  /// Read the flow tables from now on
+  rte_rcu_qsbr_thread_register(smto_cb->flow_table_rcu, worker->worker_id);
+  rte_rcu_qsbr_thread_online(smto_cb->flow_table_rcu, worker->worker_id);
 
   /// Pull packet from queue and process
   while (smto_cb->is_running) {
     nb_rx = rte_eth_rx_burst(port_id, queue_id, mbufs, MAX_BULK_SIZE);
     if (nb_rx) {
-      for (packet_index = 0; packet_index < nb_rx; packet_index++) {
-        struct rte_mbuf *pkt_mbuf = mbufs[packet_index];
-//        uint64_t start_tsc = rte_rdtsc();
-        packet_processing(pkt_mbuf, queue_id, port_id);
-//        if (used_times_index < TIME_COUNT) {
-//          used_times[used_times_index++] = GET_NANOSECOND(start_tsc);
-//        } else {
-//          time_stat(smto_cb->logger, used_times, TIME_COUNT, "offload_flow");
-//          used_times_index = 0;
-//        }
+#ifdef WORKER_BENCHMARK
+      uint64_t start_time = rte_rdtsc();
+#endif
+      /// Stage 1: prefetch the headers PREFETCH_OFFSET packets ahead and extract the tuples of the whole burst
+      nb_tuple = extract_ipv4_tuples(mbufs, nb_rx, tuples, pkt_indexes);
+      nb_tuple6 = nb_tuple < nb_rx ? extract_ipv6_tuples(mbufs, nb_rx, tuples6, pkt_indexes6) : 0;
+      if (unlikely(nb_tuple + nb_tuple6 < nb_rx)) {
+        /// The GRE tunnels share the ipv4 flow table by their inner tuples
+        nb_tuple += extract_gre_tuples(mbufs, nb_rx, tuples + nb_tuple, pkt_indexes + nb_tuple);
+      }
+      if (unlikely(nb_tuple + nb_tuple6 < nb_rx)) {
+        zlog_error(smto_cb->logger, "Packet type is not supported: %u packets.", nb_rx - nb_tuple - nb_tuple6);
+      }
+
+      /// Stage 2 to 4 for each ip version
+      if (likely(nb_tuple)) {
+        process_tuples(worker, flow_hash_map, mbufs, tuples, pkt_indexes, nb_tuple, false, cksums);
+      }
+      if (nb_tuple6) {
+        process_tuples(worker, flow6_hash_map, mbufs, tuples6, pkt_indexes6, nb_tuple6, true, cksums);
+      }
+
+      flush_offload_candidates(worker);
+      flush_closing_flows(worker);
+
+      /// Stage 5: update the checksums of the whole burst if the port cannot offload them
+      if (cksums != NULL) {
+        cksum_burst_update(cksums);
+      }
+#ifdef WORKER_BENCHMARK
+      benchmark_time += GET_NANOSECOND(start_time);
+      benchmark_packets += nb_rx;
+      if (benchmark_packets >= WORKER_BENCHMARK_PACKETS) {
+        zlog_info(benchmark_logger,
+                  "worker%u for port%u-queue%u: %.2lf ns/packet",
+                  lcore_id,
+                  port_id,
+                  queue_id,
+                  benchmark_time / (double) benchmark_packets);
+        benchmark_time = 0;
+        benchmark_packets = 0;
+      }
+#endif
+      for (uint16_t i = 0; i < nb_rx; i++) {
+        rte_eth_tx_buffer(port_id, queue_id, tx_buffer, mbufs[i]);
       }
-//      rte_delay_us_sleep(20);
-      nb_tx = rte_eth_tx_burst(port_id, queue_id,
-                               mbufs, nb_rx);
 //      zlog_info(smto_cb->logger, "worker #%u for queue #%u: %d", lcore_id, queue_id, nb_rx);
     }
-    /* Free any unsent packets. */
-    if (unlikely(nb_tx < nb_rx)) {
-      uint16_t buf;
-      for (buf = nb_tx; buf < nb_rx; buf++)
-        rte_pktmbuf_free(mbufs[buf]);
+    /// The flow keys are no longer used by the burst, so the closed connections can be removed now
+    remove_closed_flows(worker);
+    expire_idle_flows(worker);
+    /// No flow key is held across bursts, so the deleted ones can be reclaimed once every worker has passed here
+    rte_rcu_qsbr_quiescent(smto_cb->flow_table_rcu, worker->worker_id);
+#ifdef ADAPTIVE_POLL
+    if (nb_rx) {
+      idle_polls = 0;
+    } else if (++idle_polls >= IDLE_POLL_THRESHOLD) {
+      rte_eth_tx_buffer_flush(port_id, queue_id, tx_buffer);
+      idle_wait(worker);
+      idle_polls = 0;
+    }
+#endif
+    current_tsc = rte_rdtsc();
+    if (unlikely(current_tsc - last_drain_tsc > drain_tsc)) {
+      rte_eth_tx_buffer_flush(port_id, queue_id, tx_buffer);
+      last_drain_tsc = current_tsc;
+    }
+    /// The coarse time stamped on the flows by the next bursts
+    if (unlikely(current_tsc - last_aging_tsc >= aging_tick_tsc)) {
+      worker->aging_wheel.now++;
+      last_aging_tsc += aging_tick_tsc;
+    }
+#ifdef HEAVY_HITTER_OFFLOAD
+    heavy_hitter_advance(&worker->heavy_hitter, worker->flow_rules_ring, current_tsc, hh_window_tsc);
+#endif
+    if (nb_rx) {
+      worker->busy_cycles += current_tsc - last_tsc;
+    } else {
+      worker->idle_cycles += current_tsc - last_tsc;
     }
+    last_tsc = current_tsc;
   }
-  zlog_info(smto_cb->logger, "worker%u for port%u-queue%u stop working!", lcore_id, port_id, queue_id);
+  rte_eth_tx_buffer_flush(port_id, queue_id, tx_buffer);
+  rte_free(tx_buffer);
+  rte_rcu_qsbr_thread_offline(smto_cb->flow_table_rcu, worker->worker_id);
+  rte_rcu_qsbr_thread_unregister(smto_cb->flow_table_rcu, worker->worker_id);
+  zlog_info(smto_cb->logger,
+            "worker%u for port%u-queue%u stop working! busy ratio: %.2lf%%, idle waits: %lu, tx retries: %lu, tx dropped: %lu",
+            lcore_id, port_id, queue_id, get_busy_ratio(worker) * 100, worker->idle_waits,
+            worker->tx_retries, worker->tx_dropped);
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,130 @@
+/*
+ * MIT License
+ * 
+ * Copyright (c) 2022 Chenming C (ccm@ccm.ink)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <rte_eal.h>
+#include <rte_random.h>
+#include <rte_jhash.h>
+#include <zlog.h>
+
+#include "smto.h"
+#include "internal/smto_utils.h"
+#include "internal/smto_port_allocator.h"
+
+#define ALLOCATE_AMOUNT 100000
+/// The percentage of the NAT ports used before allocating.
+#define OCCUPANCY 90
+
+/**
+ * Measure the cost to allocate a NAT port when 90% of the ports are used, by the bitmap allocator and by probing the
+ * flow table for endpoint-dependent mapping, where the used ports are all towards the same peer.
+ */
+int main(int argc, char **argv) {
+  int ret;
+  ret = zlog_init("conf/zlog.conf");
+  if (ret) {
+    printf("zlog init failed\n");
+    return -1;
+  };
+
+  zlog_category_t *logger = zlog_get_category("main");
+  ret = rte_eal_init(argc, argv);
+  if (ret < 0) {
+    zlog_error(logger, "invalid EAL arguments\n");
+    goto err;
+  }
+
+  uint32_t used_ports = (NAT_PORT_MAX - NAT_PORT_MIN + 1) * OCCUPANCY / 100;
+  uint64_t *used_time = rte_malloc("used_time", sizeof(uint64_t) * ALLOCATE_AMOUNT, 0);
+  struct smto_port_allocator *allocator = rte_malloc("port_allocator", sizeof(struct smto_port_allocator), 0);
+  if (used_time == NULL || allocator == NULL) {
+    zlog_error(logger, "failed to allocate memory");
+    ret = -1;
+    goto err2;
+  }
+
+  /// Keep the occupancy by releasing each port right after it is allocated
+  init_port_allocator(allocator, NAT_PORT_MIN, NAT_PORT_MAX);
+  for (uint32_t i = 0; i < used_ports; i++) {
+    alloc_nat_port(allocator);
+  }
+  for (int i = 0; i < ALLOCATE_AMOUNT; ++i) {
+    uint64_t start = rte_rdtsc();
+    uint16_t port = alloc_nat_port(allocator);
+    used_time[i] = GET_NANOSECOND(start);
+    free_nat_port(allocator, port);
+  }
+  time_stat(logger, used_time, ALLOCATE_AMOUNT, "bitmap port allocator");
+
+  struct rte_hash_parameters flow_hash_map_parameter = {
+      .name = "nat_port_test",
+      .entries = NAT_PORT_MAX + 1,
+      .key_len = sizeof(struct rdarm_five_tuple),
+      .hash_func = rte_jhash,
+      .hash_func_init_val = 622,
+      .socket_id = (int) rte_socket_id(),
+  };
+  struct rte_hash *flow_hash_map = rte_hash_create(&flow_hash_map_parameter);
+  if (flow_hash_map == NULL) {
+    zlog_error(logger, "failed to create flow hash map: %s", rte_strerror(rte_errno));
+    ret = -1;
+    goto err2;
+  }
+
+  /// The replies from the same peer to the same SNAT address, only differ in the NAT port
+  struct rdarm_five_tuple reply = {
+      .proto = IPPROTO_TCP,
+      .ip1 = RTE_BE32(RTE_IPV4(10, 0, 0, 1)),
+      .ip2 = RTE_BE32(RTE_IPV4(5, 1, 1, 1)),
+      .port1 = RTE_BE16(443),
+  };
+  for (uint32_t i = 0; i < used_ports; i++) {
+    if (probe_nat_port(flow_hash_map, &reply, &reply.port2, NAT_PORT_MIN, NAT_PORT_MAX, (uint32_t) rte_rand()) == 0
+        || rte_hash_add_key(flow_hash_map, &reply) < 0) {
+      zlog_error(logger, "failed to fill the flow hash map at %u ports", i);
+      ret = -1;
+      goto err3;
+    }
+  }
+  uint32_t failures = 0;
+  for (int i = 0; i < ALLOCATE_AMOUNT; ++i) {
+    uint32_t sig = (uint32_t) rte_rand();
+    uint64_t start = rte_rdtsc();
+    uint16_t port = probe_nat_port(flow_hash_map, &reply, &reply.port2, NAT_PORT_MIN, NAT_PORT_MAX, sig);
+    used_time[i] = GET_NANOSECOND(start);
+    failures += port == 0;
+  }
+  time_stat(logger, used_time, ALLOCATE_AMOUNT, "endpoint-dependent port probing");
+  zlog_info(logger, "%u of %d probings found no free port", failures, ALLOCATE_AMOUNT);
+
+  err3:
+  rte_hash_free(flow_hash_map);
+  err2:
+  rte_free(allocator);
+  rte_free(used_time);
+  rte_eal_cleanup();
+  err:
+  zlog_fini();
+  return ret;
+}